@@ -2,4 +2,6 @@
 
 namespace fs {
 
+volume *g_root;
+
 }
@@ -5,6 +5,7 @@
 #include "fat_structs.h"
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 namespace fs {
 
@@ -175,16 +176,18 @@ bool volumeFat::locateEntry(directoryEntry &dest,const char *path) {
     directoryEntry *i = nullptr;
     for (;;) {
         const char *nextPart = strchr(path,'/');
-        uint32_t nextLen = nextPart? nextPart - path - 1 : strlen(path);
+        uint32_t nextLen = nextPart? nextPart - path : strlen(path);
         directory d;
         if (!openDir(d,i))
             return false;
         bool matched = false;
         while (readDir(d,dest)) {
-            if (!strncmp(path,dest.filename,nextLen)) {
+            // names must match exactly (but case-insensitively), not just share a prefix
+            if (!strncasecmp(path,dest.filename,nextLen) && !dest.filename[nextLen]) {
                 if (nextPart && dest.directory) {
                     matched = true;
                     i = &dest;
+                    path = nextPart + 1;
                     break;
                 }
                 else if (!nextPart)
@@ -0,0 +1,249 @@
+#include "display_core.h"
+#include "video.h"
+#include "keyboard.h"
+#include "timer.h"
+
+#include "pico/multicore.h"
+#include "pico/time.h"
+#include "hardware/sync.h"
+
+#include <atomic>
+#include <string.h>
+
+namespace hal {
+
+// Single producer (core 0), single consumer (core 1). head and tail are free-running byte counts
+// and each is only ever written by one side, so plain acquire/release loads and stores suffice
+// (the M0+ has no atomic read-modify-write anyway). Records never straddle the end of the buffer.
+struct commandRing {
+    static const uint32_t kSize = 4096;
+    uint8_t data[kSize];
+    std::atomic<uint32_t> head, tail;
+};
+
+enum class op: uint8_t { pad, reinit, scroll, fixedRegions, fill, glyph, string, draw };
+
+struct command {
+    op what;
+    uint8_t unused;
+    uint16_t size;      // whole record, a multiple of four
+    int16_t x, y, w, h;
+    palette p;
+    const void *data;   // glyph or bitmap, which must outlive the command
+    // string records are followed by the text
+};
+
+static commandRing s_commands;
+
+static const uint32_t kKeySize = 32;
+static uint16_t s_keys[kKeySize];
+static std::atomic<uint32_t> s_keyHead, s_keyTail;
+static volatile uint8_t s_battery;
+
+static video *s_video;
+static keyboard *s_keyboard;
+static volatile bool s_stop, s_stopped, s_running;
+
+static command *reserve(uint32_t size) {
+    size = (size + 3) & ~3;
+    uint32_t head = s_commands.head.load(std::memory_order_relaxed);
+    uint32_t offset = head % commandRing::kSize, room = commandRing::kSize - offset;
+    if (room < size) {
+        // pad out to the end so the record starts at the beginning of the buffer
+        while (commandRing::kSize - (head - s_commands.tail.load(std::memory_order_acquire)) < room)
+            tight_loop_contents();
+        command *c = (command*)(s_commands.data + offset);
+        c->what = op::pad;
+        c->size = room;
+        head += room;
+        s_commands.head.store(head,std::memory_order_release);
+        offset = 0;
+    }
+    while (commandRing::kSize - (head - s_commands.tail.load(std::memory_order_acquire)) < size)
+        tight_loop_contents();
+    command *c = (command*)(s_commands.data + offset);
+    c->size = size;
+    return c;
+}
+
+static void commit(command *c) {
+    s_commands.head.store(s_commands.head.load(std::memory_order_relaxed) + c->size,std::memory_order_release);
+    __sev();
+}
+
+static void drain() {
+    while (s_commands.tail.load(std::memory_order_acquire) != s_commands.head.load(std::memory_order_relaxed))
+        tight_loop_contents();
+}
+
+class video_proxy: public video {
+public:
+    void init() { }
+    void reinit() { send(op::reinit); }
+    int getBpp() { return s_video->getBpp(); }
+    void setScroll(int y) { send(op::scroll,0,y); }
+    void setFixedRegions(int top,int bottom) { send(op::fixedRegions,0,top,0,bottom); }
+    void draw(int x,int y,int w,int h,const void *data) {
+        // the caller owns data, so this one has to wait until core 1 is done with it
+        command *c = reserve(sizeof(command));
+        set(c,op::draw,x,y,w,h);
+        c->data = data;
+        commit(c);
+        drain();
+    }
+    void fill(int x,int y,int w,int h,const palette &p) {
+        command *c = reserve(sizeof(command));
+        set(c,op::fill,x,y,w,h);
+        c->p = p;
+        commit(c);
+    }
+    void drawGlyph(int x,int y,int w,int h,const uint8_t *glyph,const palette &p) {
+        command *c = reserve(sizeof(command));
+        set(c,op::glyph,x,y,w,h);
+        c->p = p;
+        c->data = glyph;
+        commit(c);
+    }
+    void setColor(palette &dest,rgb fore,rgb back) {
+        // no hardware involved
+        s_video->setColor(dest,fore,back);
+    }
+    void drawString(int x,int y,const palette &p,const char *string) {
+        drawString(x,y,p,string,strlen(string));
+    }
+    void drawString(int x,int y,const palette &p,const char *string,size_t len) {
+        const size_t kChunk = 256;
+        while (len) {
+            size_t part = len < kChunk? len : kChunk;
+            command *c = reserve(sizeof(command) + part);
+            set(c,op::string,x,y,part,0);
+            c->p = p;
+            memcpy(c + 1,string,part);
+            commit(c);
+            x += part * sm_fontWidth;
+            string += part;
+            len -= part;
+        }
+    }
+    void drawString(int x,int y,const palette *p,const uint8_t *attr,const char *string,size_t len) {
+        // one record per run of the same attribute rather than one per glyph
+        while (len) {
+            size_t run = 1;
+            while (run < len && attr[run] == attr[0])
+                run++;
+            drawString(x,y,p[attr[0]],string,run);
+            x += run * sm_fontWidth;
+            string += run;
+            attr += run;
+            len -= run;
+        }
+    }
+private:
+    static void set(command *c,op what,int x,int y,int w,int h) {
+        c->what = what;
+        c->x = x;
+        c->y = y;
+        c->w = w;
+        c->h = h;
+    }
+    static void send(op what,int x = 0,int y = 0,int w = 0,int h = 0) {
+        command *c = reserve(sizeof(command));
+        set(c,what,x,y,w,h);
+        commit(c);
+    }
+};
+
+class keyboard_proxy: public keyboard {
+public:
+    void init() { }
+    uint16_t getKeyEvent() {
+        uint32_t tail = s_keyTail.load(std::memory_order_relaxed);
+        if (tail == s_keyHead.load(std::memory_order_acquire))
+            return 0;
+        uint16_t ev = s_keys[tail % kKeySize];
+        s_keyTail.store(tail + 1,std::memory_order_release);
+        return ev;
+    }
+    uint8_t getBattery() { return s_battery; }
+};
+
+static video_proxy s_videoProxy;
+static keyboard_proxy s_keyboardProxy;
+
+static void execute(const command *c) {
+    switch (c->what) {
+        case op::pad: break;
+        case op::reinit: s_video->reinit(); break;
+        case op::scroll: s_video->setScroll(c->y); break;
+        case op::fixedRegions: s_video->setFixedRegions(c->y,c->h); break;
+        case op::fill: s_video->fill(c->x,c->y,c->w,c->h,c->p); break;
+        case op::glyph: s_video->drawGlyph(c->x,c->y,c->w,c->h,(const uint8_t*)c->data,c->p); break;
+        case op::string: s_video->drawString(c->x,c->y,c->p,(const char*)(c + 1),c->w); break;
+        case op::draw: s_video->draw(c->x,c->y,c->w,c->h,c->data); break;
+    }
+}
+
+static void pollKeyboard() {
+    uint16_t ev = s_keyboard->getKeyEvent();
+    uint32_t head = s_keyHead.load(std::memory_order_relaxed);
+    // if core 0 isn't reading keys, the newest ones are dropped
+    if (ev && head - s_keyTail.load(std::memory_order_acquire) < kKeySize) {
+        s_keys[head % kKeySize] = ev;
+        s_keyHead.store(head + 1,std::memory_order_release);
+    }
+    s_battery = s_keyboard->getBattery();
+}
+
+static void displayCoreMain() {
+    const uint32_t kPollUs = 1000;
+    uint32_t lastPoll = getUsTime32();
+    for (;;) {
+        uint32_t tail = s_commands.tail.load(std::memory_order_relaxed);
+        if (tail != s_commands.head.load(std::memory_order_acquire)) {
+            const command *c = (const command*)(s_commands.data + tail % commandRing::kSize);
+            execute(c);
+            s_commands.tail.store(tail + c->size,std::memory_order_release);
+        }
+        else if (s_stop)
+            break;
+        else
+            best_effort_wfe_or_timeout(make_timeout_time_us(kPollUs));
+        if (getUsTime32() - lastPoll >= kPollUs) {
+            pollKeyboard();
+            lastPoll = getUsTime32();
+        }
+    }
+    s_stopped = true;
+}
+
+void startDisplayCore() {
+    if (s_running)
+        return;
+    s_video = g_video;
+    s_keyboard = g_keyboard;
+    s_commands.head.store(0);
+    s_commands.tail.store(0);
+    s_keyHead.store(0);
+    s_keyTail.store(0);
+    s_battery = s_keyboard->getBattery();
+    s_stop = s_stopped = false;
+    g_video = &s_videoProxy;
+    g_keyboard = &s_keyboardProxy;
+    multicore_launch_core1(displayCoreMain);
+    s_running = true;
+}
+
+void stopDisplayCore() {
+    if (!s_running)
+        return;
+    s_stop = true;
+    __sev();
+    while (!s_stopped)
+        tight_loop_contents();
+    multicore_reset_core1();
+    g_video = s_video;
+    g_keyboard = s_keyboard;
+    s_running = false;
+}
+
+} // namespace hal
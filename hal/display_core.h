@@ -0,0 +1,14 @@
+#pragma once
+
+namespace hal {
+
+// Hands the current g_video and g_keyboard over to core 1. Until stopDisplayCore, g_video and
+// g_keyboard are proxies: drawing calls are queued for core 1 and return immediately, and key
+// events are polled by core 1 and queued back. Fonts and video modes are read by core 1 when
+// the commands execute, so stop the display core before changing either.
+void startDisplayCore();
+
+// waits for every queued command to reach the panel, then takes the devices back
+void stopDisplayCore();
+
+} // namespace hal
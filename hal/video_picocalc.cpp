@@ -56,8 +56,8 @@ void video_pico::setScroll(int y) {
 
 void video_pico::setFixedRegions(int top,int bottom) {
     int middle = 320 - top - bottom;
-    if (bottom)
-        bottom = 160 + bottom;
+    // panel memory is 480 lines; the 160 we never show always belong to the bottom region
+    bottom = 160 + bottom;
     uint8_t commands[] = { 0x33, 6, 
       uint8_t(top>>8), uint8_t(top), 
       uint8_t(middle>>8), uint8_t(middle),
@@ -0,0 +1,18 @@
+#include "xip.h"
+
+#include "hardware/structs/xip_ctrl.h"
+
+namespace hal {
+
+void resetXipCounters() {
+    // any write clears them
+    xip_ctrl_hw->ctr_hit = 0;
+    xip_ctrl_hw->ctr_acc = 0;
+}
+
+void getXipCounters(uint32_t &hits,uint32_t &accesses) {
+    hits = xip_ctrl_hw->ctr_hit;
+    accesses = xip_ctrl_hw->ctr_acc;
+}
+
+} // namespace hal
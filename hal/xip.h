@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace hal {
+
+// The RP2040's XIP cache counters, for measuring what running from flash costs. They count
+// accesses from both cores.
+void resetXipCounters();
+void getXipCounters(uint32_t &hits,uint32_t &accesses);
+
+} // namespace hal
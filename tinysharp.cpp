@@ -3,6 +3,8 @@
 #include "hal/storage_pico_flash.h"
 #include "hal/storage_pico_sdcard.h"
 #include "hal/timer.h"
+#include "hal/display_core.h"
+#include "hal/xip.h"
 
 #include "fs/mbr.h"
 #include "fs/fat_structs.h"
@@ -13,6 +15,8 @@
 #include "pico/stdlib.h"
 
 #include "ide/editor.h"
+#include "zmachine/machine.h"
+#include "zmachine/interface_picocalc.h"
 
 #include "font-4x6.h"
 #include "font-5x8.h"
@@ -33,6 +37,123 @@ void walkTree(fs::volume &v,fs::directoryEntry *de,uint8_t level) {
     }
 }
 
+bool isStory(const char *name) {
+    const char *dot = strrchr(name,'.');
+    // a trailing p is a story packed by tinyzc -p
+    return dot && (dot[1]=='z' || dot[1]=='Z') && dot[2]>='1' && dot[2]<='8' &&
+        (!dot[3] || ((dot[3]=='p' || dot[3]=='P') && !dot[4]));
+}
+
+void playStory(fs::volume &v,hal::keyboard *k) {
+    const int kMaxStories = 32, kMaxName = 32;
+    static char names[kMaxStories][kMaxName];
+    int count = 0;
+    fs::directory d;
+    if (v.openDir(d,nullptr)) {
+        fs::directoryEntry e;
+        while (count < kMaxStories && v.readDir(d,e))
+            if (!e.directory && strlen(e.filename) < kMaxName && isStory(e.filename))
+                strcpy(names[count++],e.filename);
+    }
+    hal::palette normal, selected;
+    hal::g_video->setColor(normal,hal::white,hal::black);
+    hal::g_video->setColor(selected,hal::black,hal::white);
+    uint8_t fh = hal::video::getFontHeight();
+    int current = 0;
+    bool redraw = true;
+    for (;;) {
+        if (redraw) {
+            hal::g_video->fill(0,0,hal::video::getScreenWidth(),hal::video::getScreenHeight(),normal);
+            if (!count)
+                hal::g_video->drawString(0,0,normal,"No stories in root directory");
+            for (int i=0; i<count; i++)
+                hal::g_video->drawString(0,i*fh,i==current? selected : normal,names[i]);
+            redraw = false;
+        }
+        auto ev = k->waitKeyEvent(10);
+        if (!(ev & hal::modifier::PRESSED_BIT))
+            continue;
+        uint8_t key = uint8_t(ev);
+        if (key == 27 || !count) {
+            hal::g_video->fill(0,0,hal::video::getScreenWidth(),hal::video::getScreenHeight(),normal);
+            return;
+        }
+        else if (key == hal::key::UP && current)
+            --current;
+        else if (key == hal::key::DOWN && current+1 < count)
+            ++current;
+        else if (key == 10)
+            break;
+        redraw = true;
+    }
+
+    char path[kMaxName+1] = "/";
+    strcat(path,names[current]);
+    char *argv[] = { (char*)"tinysharp", path };
+    interface::init(2,argv);
+    long size;
+    char *story = interface::readStory(path,&size);
+    if (story) {
+        // the interpreter keeps running while core 1 pushes its output to the panel
+        hal::startDisplayCore();
+        machine *m = new machine;
+        m->init(story,size,false);
+        hal::resetXipCounters();
+        uint32_t start = hal::getUsTime32();
+        // the story runs a slice at a time from here rather than inside machine::run, so Break
+        // can leave even a story that never stops for input; keys pressed while it runs are
+        // kept for its next read
+        const uint32_t kSliceBudget = 10000;
+        const uint8_t kTypeAhead = 16;
+        uint16_t typed[kTypeAhead];
+        uint8_t typedCount = 0;
+        char line[256] = "";
+        machine::status s = machine::status::running;
+        while (s != machine::status::quit && s != machine::status::fault) {
+            bool waiting = s != machine::status::running && !typedCount;
+            uint16_t ev = waiting? hal::g_keyboard->waitKeyEvent(10) : hal::g_keyboard->getKeyEvent();
+            if ((ev & hal::modifier::PRESSED_BIT) && uint8_t(ev) == hal::key::BREAK)
+                break;
+            if ((ev & hal::modifier::PRESSED_BIT) && typedCount < kTypeAhead)
+                typed[typedCount++] = ev;
+            if (s == machine::status::running) {
+                if ((s = m->step(kSliceBudget)) == machine::status::needs_line)
+                    line[0] = 0;
+                continue;
+            }
+            if (!typedCount) {
+                picocalc::idle();
+                continue;
+            }
+            ev = typed[0];
+            memmove(typed,typed + 1,--typedCount * sizeof(typed[0]));
+            if (s == machine::status::needs_line && picocalc::editLine(ev,line,sizeof(line))) {
+                m->provideLine(line);
+                s = machine::status::running;
+            }
+            else if (s == machine::status::needs_char) {
+                if (uint8_t ch = picocalc::readChar(ev)) {
+                    m->provideChar(ch);
+                    s = machine::status::running;
+                }
+            }
+        }
+        // how often the story (and core 1) missed the XIP cache, over the uart
+        uint32_t hits, accesses, elapsed = hal::getUsTime32() - start;
+        hal::getXipCounters(hits,accesses);
+        printf("story ran %lu ms, xip cache %lu hits of %lu accesses (%lu misses)\n",
+            (unsigned long)(elapsed / 1000),(unsigned long)hits,(unsigned long)accesses,(unsigned long)(accesses - hits));
+        // readchar flushes whatever the story printed last
+        interface::readchar();
+        delete m;
+        delete[] story;
+        hal::stopDisplayCore();
+    }
+    hal::g_video->setFixedRegions(0,0);
+    hal::g_video->setScroll(0);
+    hal::g_video->fill(0,0,hal::video::getScreenWidth(),hal::video::getScreenHeight(),normal);
+}
+
 int main()
 {
     stdio_init_all();
@@ -46,6 +167,7 @@ int main()
 
     auto sd = hal::storage_pico_sdcard::create();
     auto volume = fs::volumeFat::create(sd);
+    fs::g_root = volume;
     walkTree(*volume,nullptr,0);
 
     fs::directoryEntry de;
@@ -71,6 +193,7 @@ int main()
                 case hal::modifier::LALT_BIT | hal::modifier::PRESSED_BIT | '5': hal::video::setFont(5,8,console_font_5x8,0); break;
                 case hal::modifier::LALT_BIT | hal::modifier::PRESSED_BIT | '6': hal::video::setFont(6,8,console_font_6x8,0); break;
                 case hal::modifier::LALT_BIT | hal::modifier::PRESSED_BIT | '8': hal::video::setFont(8,8,console_font_8x8,0); break;
+                case hal::modifier::PRESSED_BIT | hal::key::F5: if (volume) playStory(*volume,k); break;
                 default: e.update(ev);
             }
             e.draw();
@@ -0,0 +1,529 @@
+#include "analysis.h"
+#include "header.h"
+#include "opcodes.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool instruction::isCall() const {
+	if (opcode < 0x80 || (opcode >= 0xC0 && opcode < 0xE0))
+		return (opcode & 31) == (uint8_t)_2op::call_2s || (opcode & 31) == (uint8_t)_2op::call_2n;
+	else if (opcode < 0xB0)
+		return (opcode & 15) == (uint8_t)_1op::call_1s || ((opcode & 15) == (uint8_t)_1op::call_1n && version >= 5);
+	else
+		return opcode == 0xE0 || opcode == 0xEC || opcode == 0xF9 || opcode == 0xFA;
+}
+
+bool instruction::isTerminal() const {
+	switch (opcode) {
+		case 0x8B: case 0x9B: case 0xAB: // ret
+		case 0x8C: case 0x9C: case 0xAC: // jump
+		case 0xB0: case 0xB1: case 0xB3: case 0xB7: case 0xB8: case 0xBA: // rtrue rfalse print_ret restart ret_popped quit
+			return true;
+		case 0x1C: case 0x3C: case 0x5C: case 0x7C: case 0xDC: // throw
+			return version >= 5;
+		default:
+			return false;
+	}
+}
+
+bool decodeInstruction(const uint8_t *b,uint32_t size,uint32_t pc,instruction &insn) {
+	insn.pc = pc;
+	insn.version = b[0];
+	if (pc >= size)
+		return false;
+	uint16_t opcode = b[pc++];
+	if (opcode == 0xBE) {
+		if (insn.version < 5)
+			return false;
+		opcode = 0x100 | b[pc++];
+	}
+	// 2OP opcode zero and the top three 2OP slots are unassigned
+	if (opcode >= 0x120 || ((opcode < 0x80 || (opcode >= 0xC0 && opcode < 0xE0)) && (!(opcode & 31) || (opcode & 31) > 0x1C)))
+		return false;
+	insn.opcode = opcode;
+	uint16_t types = opTypes[opcode >> 4] << 8;
+	if (!types)
+		types = b[pc++] << 8;
+	if (opcode==0xEC || opcode==0xFA)
+		types |= b[pc++];
+	else
+		types |= 255;
+	insn.opCount = 0;
+	while (types != 0xFFFF) {
+		uint8_t t = types >> 14;
+		insn.types[insn.opCount] = t;
+		insn.operands[insn.opCount++] = t == (uint8_t)optype::large_constant? (b[pc] << 8) | b[pc+1] : b[pc];
+		pc += t == (uint8_t)optype::large_constant? 2 : 1;
+		types = (types << 2) | 0x3;
+	}
+	uint8_t decode_byte = decode[opcode] >> version_shift[insn.version];
+	insn.dest = -1;
+	insn.branchOffset = -32768;
+	insn.branchCond = false;
+	if (decode_byte & 1)
+		insn.dest = b[pc++];
+	if (decode_byte & 2) {
+		int16_t branch_offset = b[pc++];
+		insn.branchCond = branch_offset >> 7;
+		branch_offset &= 127;
+		if (branch_offset & 64)
+			branch_offset &= 63;
+		else {
+			if (branch_offset & 32)
+				branch_offset |= 0xC0;
+			branch_offset = (branch_offset << 8) | b[pc++];
+		}
+		insn.branchOffset = branch_offset;
+	}
+	// print and print_ret are followed by inline zscii
+	if (opcode == 0xB2 || opcode == 0xB3) {
+		do {
+			if (pc + 1 >= size)
+				return false;
+			pc += 2;
+		} while (!(b[pc-2] & 0x80));
+	}
+	insn.next = pc;
+	return pc <= size;
+}
+
+namespace {
+
+struct routineInfo {
+	uint32_t addr;
+	uint32_t firstCall, callCount;
+	uint16_t locals;
+	uint16_t frame;			// linkage, locals and deepest evaluation stack
+	uint16_t eval;			// deepest evaluation stack
+	uint16_t above;			// worst evaluation stack plus callee frames above our locals, once resolved
+	uint16_t depth;			// deepest call chain starting here, once resolved
+	uint8_t state;			// 0=unresolved, 1=resolving, 2=resolved
+};
+
+struct callSite {
+	uint32_t target;
+	uint16_t stack;			// evaluation stack at the call, after arguments are popped
+	uint8_t args;
+};
+
+struct visit {
+	uint32_t pc;
+	uint16_t depth;
+};
+
+const uint16_t kMaxEval = 1024;
+
+struct walker {
+	const uint8_t *story;
+	uint32_t size, routinesOffset;
+	uint8_t shift;
+	growable<routineInfo> routines;
+	growable<callSite> calls;
+	bool exact = true, usesUndo = false;
+
+	int32_t find(uint32_t addr) {
+		for (uint32_t i=0; i<routines.count; i++)
+			if (routines[i].addr == addr)
+				return i;
+		return -1;
+	}
+
+	// walk every path through the routine body, tracking evaluation stack depth
+	bool walk(uint32_t pc,uint16_t &maxEval) {
+		growable<visit> seen, pending;
+		pending.push() = { pc, 0 };
+		maxEval = 0;
+		while (pending.count) {
+			visit v = pending[--pending.count];
+			uint32_t i = 0;
+			while (i < seen.count && seen[i].pc != v.pc)
+				i++;
+			if (i < seen.count) {
+				if (seen[i].depth >= v.depth)
+					continue;
+				seen[i].depth = v.depth;
+			}
+			else
+				seen.push() = v;
+			instruction insn;
+			if (!decodeInstruction(story,size,v.pc,insn))
+				return false;
+			int depth = v.depth;
+			for (uint8_t j=0; j<insn.opCount; j++)
+				if (insn.types[j] == (uint8_t)optype::variable && !insn.operands[j])
+					--depth;
+			if (insn.opcode == 0xE8) // push
+				++depth;
+			else if (insn.opcode == 0xE9 || insn.opcode == 0xB8 || (insn.opcode == 0xB9 && insn.version < 5)) // pull, ret_popped, pop
+				--depth;
+			else if (insn.opcode == 0x109) // save_undo
+				usesUndo = true;
+			if (depth < 0)
+				return false;
+			if (insn.isCall()) {
+				if (insn.types[0] == (uint8_t)optype::large_constant && insn.operands[0]) {
+					callSite &c = calls.push();
+					c.target = routinesOffset + (insn.operands[0] << shift);
+					c.stack = depth;
+					c.args = insn.opCount - 1;
+				}
+				else if (insn.types[0] == (uint8_t)optype::variable)
+					exact = false;
+			}
+			if (!insn.dest)
+				++depth;
+			if (depth > kMaxEval)
+				return false;
+			if (depth > maxEval)
+				maxEval = depth;
+			if (insn.branchOffset != -32768 && insn.branchOffset != 0 && insn.branchOffset != 1)
+				pending.push() = { insn.branchTarget(), (uint16_t)depth };
+			if (insn.opcode == 0x8C || insn.opcode == 0x9C)
+				pending.push() = { insn.next + (insn.opcode == 0x8C? (int16_t)insn.operands[0] : insn.operands[0]) - 2, (uint16_t)depth };
+			else if (insn.opcode == 0xAC) // computed jump
+				return false;
+			else if (!insn.isTerminal())
+				pending.push() = { insn.next, (uint16_t)depth };
+		}
+		return true;
+	}
+
+	// returns false on recursion
+	bool resolve(uint32_t index) {
+		routineInfo &r = routines[index];
+		if (r.state == 2)
+			return true;
+		else if (r.state == 1)
+			return false;
+		r.state = 1;
+		uint16_t above = r.eval, depth = 1;
+		for (uint32_t i=0; i<r.callCount; i++) {
+			callSite &c = calls[r.firstCall + i];
+			int32_t callee = find(c.target);
+			if (callee < 0 || !resolve(callee))
+				return false;
+			routineInfo &t = routines[callee];
+			uint16_t need = c.stack + 3 + (t.locals > c.args? t.locals : c.args) + t.above;
+			if (need > above)
+				above = need;
+			if (t.depth + 1 > depth)
+				depth = t.depth + 1;
+		}
+		// routines[] doesn't move during resolution, so r is still valid
+		r.above = above;
+		r.depth = depth;
+		r.state = 2;
+		return true;
+	}
+};
+
+}
+
+bool analyzeStory(const uint8_t *story,uint32_t storySize,storyAnalysis &result) {
+	const storyHeader *h = (const storyHeader*) story;
+	walker w;
+	w.story = story;
+	w.size = storySize;
+	w.shift = h->version==3? 1 : h->version<=7? 2 : 3;
+	w.routinesOffset = h->version==7? h->routinesOffsetDiv8.getU() << 3 : 0;
+	// the initial pc isn't a routine; it runs with no frame and no locals
+	routineInfo &main = w.routines.push();
+	main.addr = h->initialPCAddr.getU();
+	main.locals = 0;
+	main.callCount = 0;
+	result.maxFrame = 0;
+	for (uint32_t i=0; i<w.routines.count; i++) {
+		routineInfo &r = w.routines[i];
+		uint32_t pc = r.addr;
+		if (i) {
+			if (pc >= storySize || story[pc] > 15) {
+				w.exact = false;
+				r.locals = 0;
+				continue;
+			}
+			r.locals = story[pc++];
+			if (h->version < 5)
+				pc += r.locals << 1;
+		}
+		r.firstCall = w.calls.count;
+		r.state = 0;
+		uint16_t maxEval;
+		if (!w.walk(pc,maxEval))
+			w.exact = false;
+		r.callCount = w.calls.count - r.firstCall;
+		r.eval = maxEval;
+		r.frame = (i? 3 : 0) + r.locals + maxEval;
+		if (r.frame > result.maxFrame)
+			result.maxFrame = r.frame;
+		for (uint32_t j=r.firstCall; j<w.calls.count; j++)
+			if (w.find(w.calls[j].target) < 0) {
+				routineInfo &n = w.routines.push();
+				n.addr = w.calls[j].target;
+				n.callCount = 0;
+				n.frame = n.eval = 0;
+			}
+	}
+	result.routineCount = w.routines.count - 1;
+	result.usesUndo = h->version >= 5 && (w.usesUndo || !w.exact);
+	if (w.exact && w.resolve(0)) {
+		result.maxStack = w.routines[0].above;
+		result.maxCallDepth = w.routines[0].depth - 1;
+		return true;
+	}
+	result.maxStack = result.maxCallDepth = 0;
+	return false;
+}
+
+namespace {
+
+// one decoded instruction of a routine being split into blocks
+struct node {
+	uint32_t pc, next;
+	uint32_t targets[2];
+	uint8_t targetCount;
+	bool fallsThrough, ends;
+};
+
+int compareNodes(const void *a,const void *b) {
+	uint32_t x = ((const node*)a)->pc, y = ((const node*)b)->pc;
+	return x < y? -1 : x > y;
+}
+
+int compareAddresses(const void *a,const void *b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y? -1 : x > y;
+}
+
+int compareRoutines(const void *a,const void *b) {
+	uint32_t x = ((const storyGraph::routine*)a)->addr, y = ((const storyGraph::routine*)b)->addr;
+	return x < y? -1 : x > y;
+}
+
+}
+
+int32_t storyGraph::find(uint32_t addr) const {
+	for (uint32_t i=0; i<routines.count; i++)
+		if (routines[i].addr == addr)
+			return i;
+	return -1;
+}
+
+bool storyGraph::walk(const uint8_t *story,uint32_t storySize,routine &r) {
+	growable<node> nodes;
+	growable<uint32_t> pending, targets;
+	bool complete = true;
+	r.firstCall = calls.count;
+	pending.push() = r.entry;
+	while (pending.count) {
+		uint32_t pc = pending[--pending.count];
+		uint32_t i = 0;
+		while (i < nodes.count && nodes[i].pc != pc)
+			i++;
+		if (i < nodes.count)
+			continue;
+		instruction insn;
+		if (!decodeInstruction(story,storySize,pc,insn)) {
+			complete = false;
+			continue;
+		}
+		node &n = nodes.push();
+		n.pc = pc;
+		n.next = insn.next;
+		n.targetCount = 0;
+		n.fallsThrough = !insn.isTerminal();
+		n.ends = !n.fallsThrough;
+		if (insn.isCall() && insn.types[0] == (uint8_t)optype::large_constant && insn.operands[0]) {
+			uint32_t target = m_routinesOffset + (insn.operands[0] << m_shift);
+			uint32_t j = r.firstCall;
+			while (j < calls.count && calls[j] != target)
+				j++;
+			if (j == calls.count)
+				calls.push() = target;
+		}
+		if (insn.branchOffset != -32768) {
+			n.ends = true;
+			// offsets 0 and 1 return instead
+			if (insn.branchOffset != 0 && insn.branchOffset != 1)
+				n.targets[n.targetCount++] = insn.branchTarget();
+		}
+		if (insn.opcode == 0x8C || insn.opcode == 0x9C)
+			n.targets[n.targetCount++] = insn.next + (insn.opcode == 0x8C? (int16_t)insn.operands[0] : insn.operands[0]) - 2;
+		else if (insn.opcode == 0xAC) // computed jump
+			complete = false;
+		for (uint8_t j=0; j<n.targetCount; j++)
+			pending.push() = targets.push() = n.targets[j];
+		if (n.fallsThrough)
+			pending.push() = n.next;
+	}
+	qsort(nodes.data,nodes.count,sizeof(node),compareNodes);
+	qsort(targets.data,targets.count,sizeof(uint32_t),compareAddresses);
+	// a block starts at the entry, at anything jumped to, after anything that ends a block, and
+	// wherever the instructions aren't contiguous
+	auto isLeader = [&](uint32_t i) {
+		const node &n = nodes[i];
+		return !i || n.pc == r.entry || nodes[i-1].ends || nodes[i-1].next != n.pc ||
+			bsearch(&n.pc,targets.data,targets.count,sizeof(uint32_t),compareAddresses);
+	};
+	r.firstBlock = blocks.count;
+	for (uint32_t i=0; i<nodes.count; i++) {
+		const node &n = nodes[i];
+		if (isLeader(i)) {
+			block &b = blocks.push();
+			b.start = n.pc;
+			b.instructions = 0;
+			b.successorCount = 0;
+			b.firstSuccessor = successors.count;
+		}
+		block &b = blocks[blocks.count-1];
+		b.end = n.next;
+		b.instructions++;
+		if (i+1 == nodes.count || isLeader(i+1)) {
+			for (uint8_t j=0; j<n.targetCount; j++)
+				successors.push() = n.targets[j];
+			if (n.fallsThrough)
+				successors.push() = n.next;
+			b.successorCount = successors.count - b.firstSuccessor;
+		}
+	}
+	r.blockCount = blocks.count - r.firstBlock;
+	r.callCount = calls.count - r.firstCall;
+	r.complete = complete;
+	return complete;
+}
+
+bool storyGraph::add(const uint8_t *story,uint32_t storySize,uint32_t addr,source found) {
+	uint32_t blockMark = blocks.count, successorMark = successors.count, callMark = calls.count;
+	routine &r = routines.push();
+	r.addr = r.entry = addr;
+	r.found = found;
+	r.locals = 0;
+	if (found != fromStart) {
+		if (addr >= storySize || story[addr] > 15) {
+			if (found != fromCall) {
+				--routines.count;
+				return false;
+			}
+			// called, so it's listed, but there's nothing to walk
+			r.complete = false;
+			r.firstBlock = blocks.count;
+			r.firstCall = calls.count;
+			r.blockCount = r.callCount = 0;
+			return false;
+		}
+		r.locals = story[addr];
+		r.entry = addr + 1 + (story[0] < 5? r.locals << 1 : 0);
+	}
+	// something that merely looks like a packed address has to decode cleanly to count
+	if (!walk(story,storySize,r) && found != fromStart && found != fromCall) {
+		--routines.count;
+		blocks.count = blockMark;
+		successors.count = successorMark;
+		calls.count = callMark;
+		return false;
+	}
+	return true;
+}
+
+void storyGraph::build(const uint8_t *story,uint32_t storySize) {
+	const storyHeader *h = (const storyHeader*) story;
+	m_shift = h->version==3? 1 : h->version<=7? 2 : 3;
+	m_routinesOffset = h->version==7? h->routinesOffsetDiv8.getU() << 3 : 0;
+	routines.count = blocks.count = successors.count = calls.count = 0;
+	add(story,storySize,h->initialPCAddr.getU(),fromStart);
+	// add walks each routine as it goes, so one pass reaches everything called from from onward
+	auto followCalls = [&](uint32_t from) {
+		for (uint32_t i=from; i<routines.count; i++)
+			for (uint32_t j=0; j<routines[i].callCount; j++) {
+				uint32_t target = calls[routines[i].firstCall + j];
+				if (find(target) < 0)
+					add(story,storySize,target,fromCall);
+			}
+	};
+	followCalls(0);
+
+	uint32_t candidates = routines.count, high = h->highMemoryAddr.getU();
+	auto candidate = [&](uint32_t addr,source found) {
+		if (addr + 1 >= storySize)
+			return;
+		uint32_t target = m_routinesOffset + (((story[addr] << 8) | story[addr+1]) << m_shift);
+		if (target <= m_routinesOffset || target < high || target >= storySize || story[target] > 15 || find(target) >= 0)
+			return;
+		// nor can it start inside code we already know about
+		for (uint32_t i=0; i<blocks.count; i++)
+			if (target >= blocks[i].start && target < blocks[i].end)
+				return;
+		add(story,storySize,target,found);
+	};
+	// every even-sized property value, a word at a time
+	uint32_t objects = h->objectTableAddr.getU() + (h->version<4? 31*2 : 63*2);
+	uint8_t entrySize = h->version<4? 9 : 14, propOffset = h->version<4? 7 : 12;
+	uint32_t firstProps = objects + propOffset + 1 < storySize? (story[objects+propOffset] << 8) | story[objects+propOffset+1] : 0;
+	for (uint32_t o=objects; o + entrySize <= firstProps; o+=entrySize) {
+		uint32_t addr = (story[o+propOffset] << 8) | story[o+propOffset+1];
+		if (addr >= storySize)
+			continue;
+		addr += 1 + (story[addr] << 1);
+		while (addr < storySize && story[addr]) {
+			uint8_t size;
+			if (h->version < 4)
+				size = (story[addr++] >> 5) + 1;
+			else if (story[addr] & 128) {
+				size = story[++addr] & 63;
+				if (!size)
+					size = 64;
+				++addr;
+			}
+			else
+				size = story[addr++] & 64? 2 : 1;
+			if (!(size & 1))
+				for (uint8_t i=0; i<size; i+=2)
+					candidate(addr + i,fromProperty);
+			addr += size;
+		}
+	}
+	// then any other table below high memory, at any alignment since byte arrays needn't be even
+	for (uint32_t addr=sizeof(storyHeader); addr + 1 < high; addr++)
+		candidate(addr,fromTable);
+	// globals last, since they hold plenty of plain numbers
+	for (uint32_t i=0; i<240; i++)
+		candidate(h->globalVarsTableAddr.getU() + i*2,fromGlobal);
+	followCalls(candidates);
+	// a guess that turned out to be in the middle of something found after it isn't a routine
+	uint32_t kept = 0;
+	for (uint32_t i=0; i<routines.count; i++) {
+		const routine &r = routines[i];
+		bool inside = false;
+		for (uint32_t j=0; j<routines.count && r.found >= fromProperty && !inside; j++)
+			for (uint32_t k=0; j!=i && k<routines[j].blockCount && !inside; k++) {
+				const block &b = blocks[routines[j].firstBlock + k];
+				inside = r.addr >= b.start && r.addr < b.end;
+			}
+		if (!inside)
+			routines[kept++] = r;
+	}
+	routines.count = kept;
+	qsort(routines.data,routines.count,sizeof(routine),compareRoutines);
+}
+
+uint16_t storyChecksum(const uint8_t *story,uint32_t storySize) {
+	uint16_t sum = 0;
+	for (uint32_t i=0x40; i<storySize; i++)
+		sum += story[i];
+	return sum;
+}
+
+void analysisCache::describe(const uint8_t *story,uint32_t storySize) {
+	const storyHeader *h = (const storyHeader*) story;
+	memset(this,0,sizeof(*this));
+	memcpy(magic,"TZAC",4);
+	storyLength = storySize;
+	version = kVersion;
+	checksum = storyChecksum(story,storySize);
+	memcpy(serial,h->serial,sizeof(serial));
+}
+
+bool analysisCache::matches(const analysisCache &expected) const {
+	return !memcmp(this,&expected,offsetof(analysisCache,analysis));
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Static analysis of a story file, shared by the interpreter and zdis.
+
+struct instruction {
+	uint32_t pc, next;		// address of this instruction and of the one following it
+	uint16_t opcode;		// extended opcodes are 0x100 | n
+	uint8_t version, opCount;
+	uint8_t types[8];		// optype of each operand
+	uint16_t operands[8];
+	int16_t dest;			// store variable, or -1
+	int16_t branchOffset;	// -32768 if there's no branch, 0 and 1 are rfalse/rtrue
+	bool branchCond;
+	uint32_t branchTarget() const { return next + branchOffset - 2; }
+	bool isCall() const;
+	// true if execution can never fall through to next
+	bool isTerminal() const;
+};
+
+// decodes the instruction at pc; returns false if it isn't valid for this story's version
+bool decodeInstruction(const uint8_t *story,uint32_t storySize,uint32_t pc,instruction &insn);
+
+// minimal growable array; everything stored in it is trivially copyable
+template <typename T> struct growable {
+	T *data = nullptr;
+	uint32_t count = 0, capacity = 0;
+	growable() = default;
+	growable(const growable&) = delete;
+	~growable() { delete[] data; }
+	T &push() {
+		if (count == capacity) {
+			capacity = capacity? capacity * 2 : 64;
+			T *n = new T[capacity];
+			if (count)
+				memcpy(n,data,count * sizeof(T));
+			delete[] data;
+			data = n;
+		}
+		return data[count++];
+	}
+	T &operator[](uint32_t i) { return data[i]; }
+	const T &operator[](uint32_t i) const { return data[i]; }
+};
+
+// Every routine found by following direct calls from the initial pc, plus packed addresses in
+// object properties, globals and other tables in dynamic memory that decode cleanly as routines,
+// each split into basic blocks.
+// Blocks end at branches, jumps and returns; calls don't end a block. Edges are kept as
+// addresses (block starts and routine addresses) so they survive sorting.
+struct storyGraph {
+	enum source: uint8_t { fromStart, fromCall, fromProperty, fromGlobal, fromTable };
+	struct block {
+		uint32_t start, end;		// end is the address after the last instruction
+		uint16_t instructions;
+		uint16_t successorCount;
+		uint32_t firstSuccessor;	// into successors
+	};
+	struct routine {
+		uint32_t addr;				// the locals count, or the initial pc for the start routine
+		uint32_t entry;				// first instruction
+		uint8_t locals;
+		source found;
+		bool complete;				// false if some path couldn't be followed (bad opcode, computed jump)
+		uint32_t firstBlock, blockCount;
+		uint32_t firstCall, callCount;	// into calls, one entry per distinct callee
+	};
+	growable<routine> routines;		// in address order once build returns
+	growable<block> blocks;
+	growable<uint32_t> successors, calls;
+
+	void build(const uint8_t *story,uint32_t storySize);
+	int32_t find(uint32_t addr) const;	// index into routines, or -1
+private:
+	bool add(const uint8_t *story,uint32_t storySize,uint32_t addr,source found);
+	bool walk(const uint8_t *story,uint32_t storySize,routine &r);
+	uint32_t m_routinesOffset;
+	uint8_t m_shift;
+};
+
+struct storyAnalysis {
+	uint16_t maxStack;		// words of stack needed in the worst case, or 0 if that's undecidable
+	uint16_t maxFrame;		// largest single frame (linkage, locals, and evaluation stack)
+	uint16_t maxCallDepth;	// deepest static call chain, or 0 if undecidable
+	uint16_t routineCount;	// routines reachable through direct calls
+	bool usesUndo;			// save_undo is reachable (or might be, if coverage is incomplete)
+};
+
+// walks every routine reachable from the initial pc through direct calls.
+// returns true if the stack bound is exact.
+bool analyzeStory(const uint8_t *story,uint32_t storySize,storyAnalysis &result);
+
+// sum of every byte after the header, as used by the verify opcode
+uint16_t storyChecksum(const uint8_t *story,uint32_t storySize);
+
+// sidecar record stored next to the story so later loads can skip analyzeStory
+struct analysisCache {
+	static const uint16_t kVersion = 1;	// bump whenever storyAnalysis or the analysis itself changes
+	char magic[4];
+	uint32_t storyLength;
+	uint16_t version;
+	uint16_t checksum;		// computed, not the header field (tinyz doesn't fill that in)
+	char serial[6];
+	storyAnalysis analysis;
+
+	void describe(const uint8_t *story,uint32_t storySize);
+	// true if this record was written by this interpreter version for the same story as expected
+	bool matches(const analysisCache &expected) const;
+};
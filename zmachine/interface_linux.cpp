@@ -0,0 +1,382 @@
+#include "machine.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+// Unlike the macOS backend, everything written to stdout (including escape sequences) sits in
+// one big stdio buffer until we're about to wait for input, the terminal stays in raw mode for
+// the whole session, and the window size is only asked for again after a SIGWINCH.
+
+static struct termios orig_termios;
+static bool raw_session;
+
+static char *script_text;
+static long script_size, script_offset;
+static bool nostatus;
+static char story_name[256], cache_name[256];
+
+static char output_buffer[16384];
+static volatile sig_atomic_t resized = 1;
+static uint8_t cached_width = 80, cached_height = 24;
+static uint8_t split;
+
+// keeps the upper window out of the terminal's scroll region, so the status line stays put
+// and only has to be drawn again when it changes. setting the margins homes the cursor, hence
+// the save and restore around it.
+static void set_margins() {
+	if (nostatus)
+		;
+	else if (split && split < cached_height)
+		printf("\0337\033[%d;%dr\0338",split + 1,cached_height);
+	else
+		fputs("\0337\033[r\0338",stdout);
+}
+
+static void standard_mode() {
+	if (split && !nostatus)
+		fputs("\033[r",stdout);
+	fflush(stdout);
+	if (raw_session)
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+// ^C and friends don't run atexit handlers, so put the terminal back here before dying the usual
+// way. Only async-signal-safe calls, which means whatever is still in the stdio buffer is lost.
+static void on_fatal_signal(int sig) {
+	if (split && !nostatus)
+		write(STDOUT_FILENO,"\033[r",3);
+	if (raw_session)
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+#if ENABLE_PROFILE
+static machine *profiled;
+static const char *profile_name;
+static uint16_t profile_checksum;
+
+// run at exit, since the story can also end when input runs out
+static void write_profile() {
+	FILE *f = fopen(profile_name,"w");
+	if (!f) {
+		fprintf(stderr,"unable to write profile %s\n",profile_name);
+		return;
+	}
+	// headed by the checksum of the unpacked story, so tinyz can tell which build it came from
+	fprintf(f,"tzprofile %04x\n",profile_checksum);
+	profiled->writeProfile(f);
+	fclose(f);
+}
+#endif
+
+static void on_resize(int) {
+	resized = 1;
+}
+
+// returns the next byte of keyboard input, exiting on end of file
+static uint8_t read_byte() {
+	uint8_t ch;
+	if (read(STDIN_FILENO, &ch, 1) != 1)
+		exit(0);
+	return ch;
+}
+
+// raw mode means we do our own echo and erase
+static void edit_line(char *dest,unsigned destSize) {
+	unsigned len = 0;
+	fflush(stdout);
+	if (!raw_session) {
+		if (!fgets(dest,destSize,stdin))
+			exit(0);
+		return;
+	}
+	for (;;) {
+		uint8_t ch = read_byte();
+		if (ch == 13 || ch == 10) {
+			fputc('\n',stdout);
+			dest[len++] = '\n';
+			break;
+		}
+		else if ((ch == 127 || ch == 8) && len) {
+			--len;
+			fputs("\b \b",stdout);
+		}
+		else if (ch == 27) {
+			// swallow cursor keys and the like
+			if (read_byte() == '[')
+				while (read_byte() < 0x40)
+					;
+		}
+		else if (ch >= 32 && ch < 127 && len + 2 < destSize) {
+			dest[len++] = ch;
+			fputc(ch,stdout);
+		}
+		fflush(stdout);
+	}
+	dest[len] = 0;
+	fflush(stdout);
+}
+
+void interface::init(int argc,char **argv) {
+	setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+	if (argc > 1) {
+		snprintf(story_name,sizeof(story_name),"%s",argv[1]);
+		snprintf(cache_name,sizeof(cache_name),"%s.tzc",argv[1]);
+	}
+
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(argv[i],"-script") && i+1<argc) {
+			script_text = readStory(argv[++i],&script_size);
+			if (!script_text) {
+					fprintf(stderr,"unable to open script file %s\n",argv[i]);
+					exit(1);
+			}
+			else
+				nostatus = true;
+		}
+	}
+
+	if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &orig_termios) == 0) {
+		struct termios raw_termios = orig_termios;
+		cfmakeraw(&raw_termios);
+		// keep newline translation on output and let ^C through as a signal
+		raw_termios.c_oflag |= OPOST | ONLCR;
+		raw_termios.c_lflag |= ISIG;
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_termios);
+		raw_session = true;
+	}
+	atexit(standard_mode);
+	signal(SIGINT, on_fatal_signal);
+	signal(SIGTERM, on_fatal_signal);
+	signal(SIGHUP, on_fatal_signal);
+	signal(SIGWINCH, on_resize);
+}
+
+static int window;
+
+void interface::putchar(int ch) {
+	if (!window || !nostatus)
+		putc(ch==13?10:ch, stdout);
+}
+
+void interface::readline(char *dest,unsigned destSize) {
+	if (script_offset < script_size) {
+		unsigned offset = 0;
+		while (destSize--) {
+			dest[offset] = script_text[script_offset++];
+			if (dest[offset++] == '\n')
+				break;
+		}
+		dest[offset] = 0;
+		printf("%s",dest);
+		if (script_offset >= script_size)
+			printf("{end of script, resuming interactive input}\n");
+		return;
+	}
+
+	edit_line(dest,destSize);
+}
+
+int interface::readchar() {
+	if (nostatus)
+		return 32;
+	fflush(stdout);
+	if (!raw_session)
+		return getchar();
+	uint8_t ch = read_byte();
+	if (ch == 127)
+		return 8;
+	else if (ch == 27 && read_byte() == '[') {
+		// cursor keys map to 129-132
+		switch (ch = read_byte()) {
+			case 'A': return 129;
+			case 'B': return 130;
+			case 'D': return 131;
+			case 'C': return 132;
+		}
+		while (ch < 0x40)
+			ch = read_byte();
+		return 27;
+	}
+	return ch;
+}
+
+void interface::setTextStyle(uint8_t style) {
+	if (nostatus)
+		;
+	else if (style == 1)
+		fputs("\033[7m",stdout);
+	else if (style == 0)
+		fputs("\033[0m",stdout);
+}
+
+void interface::setTextColor(uint8_t fore,uint8_t back) {
+	// terminal colors are black, red, green, yellow, blue, magenta, cyan, white, (reserved), default
+	// interpreter colors are current, default, black, red, green, yellow, blue, magenta, cyan, white
+	if (nostatus)
+		;
+	else {
+		if (fore != 0)
+			printf("\033[3%cm"," 901234567"[fore]);
+		if (back != 0)
+			printf("\033[4%cm"," 901234567"[back]);
+	}
+}
+
+void interface::setWindow(uint8_t w) {
+	window = w;
+	if (nostatus)
+		;
+	else if (window)
+		fputs("\0337\033[H",stdout);
+	else
+		fputs("\0338",stdout);
+}
+
+void interface::splitWindow(uint8_t lines) {
+	split = lines;
+	set_margins();
+}
+
+void interface::eraseWindow(uint8_t cmd) {
+	if (nostatus)
+		;
+	else if (cmd == 1)
+		fputs("\033[H\033[2K",stdout);
+	else
+		fputs("\033[2J",stdout);
+}
+
+void interface::setCursor(uint8_t x,uint8_t y) {
+	if (nostatus)
+		;
+	else
+		printf("\033[%d;%dH",y,x);
+}
+
+void interface::updateExtents(uint8_t &width,uint8_t &height) {
+	if (resized) {
+		resized = 0;
+		struct winsize ws;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col && ws.ws_row) {
+			cached_width = ws.ws_col > 255? 255 : ws.ws_col;
+			cached_height = ws.ws_row > 255? 255 : ws.ws_row;
+		}
+		if (split)
+			set_margins();
+	}
+	width = cached_width;
+	height = cached_height;
+}
+
+bool interface::writeSaveData(chunk *chunks,uint32_t count) {
+	char buf[64];
+	printf("Save as?");
+	edit_line(buf,sizeof(buf));
+	buf[strcspn(buf,"\n")] = 0;
+	if (buf[0]==0)
+		return false;
+	FILE *f = fopen(buf,"wb");
+	if (!f) {
+		printf("{cannot create file}\n");
+		return false;
+	}
+	for (uint32_t i=0; i<count; i++)
+		fwrite(chunks[i].data,1,chunks[i].size,f);
+	fclose(f);
+	return true;
+}
+
+bool interface::readSaveData(chunk *chunks,uint32_t count) {
+	char buf[64];
+	printf("Load from?");
+	edit_line(buf,sizeof(buf));
+	buf[strcspn(buf,"\n")] = 0;
+	if (buf[0]==0)
+		return false;
+	FILE *f = fopen(buf,"rb");
+	if (!f) {
+		printf("{file not found}\n");
+		return false;
+	}
+	for (uint32_t i=0; i<count; i++)
+		fread(chunks[i].data,1,chunks[i].size,f);
+	fclose(f);
+	return true;
+}
+
+bool interface::readCache(void *data,uint32_t size) {
+	FILE *f = fopen(cache_name,"rb");
+	if (!f)
+		return false;
+	bool result = fread(data,1,size,f) == size;
+	fclose(f);
+	return result;
+}
+
+bool interface::writeCache(const void *data,uint32_t size) {
+	FILE *f = fopen(cache_name,"wb");
+	if (!f)
+		return false;
+	bool result = fwrite(data,1,size,f) == size;
+	fclose(f);
+	return result;
+}
+
+char* interface::readStory(const char *name,long *sizePtr) {
+	FILE *f = fopen(name,"rb");
+	if (!f)
+		return nullptr;
+	fseek(f,0,SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	char *story = new char[size];
+	if (sizePtr)
+		*sizePtr = size;
+	fread(story,1,size,f);
+	fclose(f);
+	return story;
+}
+
+bool interface::readStoryPart(void *dest,uint32_t offset,uint32_t size) {
+	FILE *f = fopen(story_name,"rb");
+	if (!f)
+		return false;
+	bool result = !fseek(f,offset,SEEK_SET) && fread(dest,1,size,f) == size;
+	fclose(f);
+	return result;
+}
+
+int main(int argc,char **argv) {
+	if (argc < 2) {
+		fprintf(stderr,"usage: %s story [-debug] [-script file] [-profile file]\n",argv[0]);
+		return 1;
+	}
+	interface::init(argc,argv);
+	long size;
+	char *story = interface::readStory(argv[1],&size);
+	if (story) {
+		machine *m = new machine;
+		m->init(story,size,argc>2&&!strcmp(argv[2],"-debug"));
+#if ENABLE_PROFILE
+		for (int i=2; i<argc-1; i++)
+			if (!strcmp(argv[i],"-profile"))
+				profile_name = argv[++i];
+		if (profile_name) {
+			profiled = m;
+			profile_checksum = packedStory::is(story)? ((packedStory*)story)->checksum : storyChecksum((uint8_t*)story,size);
+			m->startProfile();
+			atexit(write_profile);
+		}
+#endif
+		return m->run() == machine::status::fault;
+	}
+	fprintf(stderr,"unable to open story file %s\n",argv[1]);
+	return 1;
+}
@@ -16,6 +16,45 @@ static struct termios orig_termios, raw_termios;
 static char *script_text;
 static long script_size, script_offset;
 static bool nostatus;
+static char story_name[256], cache_name[256];
+static uint8_t split, rows;
+
+// same idea as the Linux backend: the upper window sits outside the scroll region so the status
+// line only has to be redrawn when it changes
+static void set_margins() {
+	if (nostatus)
+		;
+	else if (split && split < rows)
+		printf("\0337\033[%d;%dr\0338",split + 1,rows);
+	else
+		printf("\0337\033[r\0338");
+	fflush(stdout);
+}
+
+static void reset_margins() {
+	if (split && !nostatus)
+		printf("\033[r");
+	fflush(stdout);
+}
+
+#if ENABLE_PROFILE
+static machine *profiled;
+static const char *profile_name;
+static uint16_t profile_checksum;
+
+// run at exit, since the story can also end when input runs out
+static void write_profile() {
+	FILE *f = fopen(profile_name,"w");
+	if (!f) {
+		fprintf(stderr,"unable to write profile %s\n",profile_name);
+		return;
+	}
+	// headed by the checksum of the unpacked story, so tinyz can tell which build it came from
+	fprintf(f,"tzprofile %04x\n",profile_checksum);
+	profiled->writeProfile(f);
+	fclose(f);
+}
+#endif
 
 static void standard_mode() {
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
@@ -28,7 +67,12 @@ static void raw_mode() {
 void interface::init(int argc,char **argv) {
 	tcgetattr(STDIN_FILENO, &orig_termios);
 	atexit(standard_mode);
+	atexit(reset_margins);
 	cfmakeraw(&raw_termios);
+	if (argc > 1) {
+		snprintf(story_name,sizeof(story_name),"%s",argv[1]);
+		snprintf(cache_name,sizeof(cache_name),"%s.tzc",argv[1]);
+	}
 
 	for (int i=1; i<argc; i++) {
 		if (!strcmp(argv[i],"-script") && i+1<argc) {
@@ -112,6 +156,11 @@ void interface::setWindow(uint8_t w) {
     fflush(stdout);
 }
 
+void interface::splitWindow(uint8_t lines) {
+	split = lines;
+	set_margins();
+}
+
 void interface::eraseWindow(uint8_t cmd) {
 	if (nostatus)
 		;
@@ -138,6 +187,11 @@ void interface::updateExtents(uint8_t &width,uint8_t &height) {
 		if (result != -1) {
 			height = ws.ws_row;
 			width = ws.ws_col;
+			if (rows != height) {
+				rows = height;
+				if (split)
+					set_margins();
+			}
 		}
 	}
 }
@@ -178,6 +232,24 @@ bool interface::readSaveData(chunk *chunks,uint32_t count) {
 	return true;
 }
 
+bool interface::readCache(void *data,uint32_t size) {
+	FILE *f = fopen(cache_name,"rb");
+	if (!f)
+		return false;
+	bool result = fread(data,1,size,f) == size;
+	fclose(f);
+	return result;
+}
+
+bool interface::writeCache(const void *data,uint32_t size) {
+	FILE *f = fopen(cache_name,"wb");
+	if (!f)
+		return false;
+	bool result = fwrite(data,1,size,f) == size;
+	fclose(f);
+	return result;
+}
+
 char* interface::readStory(const char *name,long *sizePtr) {
 	FILE *f = fopen(name,"rb");
     if (!f)
@@ -193,11 +265,33 @@ char* interface::readStory(const char *name,long *sizePtr) {
     return story;
 }
 
+bool interface::readStoryPart(void *dest,uint32_t offset,uint32_t size) {
+	FILE *f = fopen(story_name,"rb");
+	if (!f)
+		return false;
+	bool result = !fseek(f,offset,SEEK_SET) && fread(dest,1,size,f) == size;
+	fclose(f);
+	return result;
+}
+
 int main(int argc,char **argv) {
 	interface::init(argc,argv);
-	char *story = interface::readStory(argv[1]);
+	long size;
+	char *story = interface::readStory(argv[1],&size);
 	if (story) {
 		machine *m = new machine;
-		m->init(story,argc>2&&!strcmp(argv[2],"-debug"));
+		m->init(story,size,argc>2&&!strcmp(argv[2],"-debug"));
+#if ENABLE_PROFILE
+		for (int i=2; i<argc-1; i++)
+			if (!strcmp(argv[i],"-profile"))
+				profile_name = argv[++i];
+		if (profile_name) {
+			profiled = m;
+			profile_checksum = packedStory::is(story)? ((packedStory*)story)->checksum : storyChecksum((uint8_t*)story,size);
+			m->startProfile();
+			atexit(write_profile);
+		}
+#endif
+		return m->run() == machine::status::fault;
 	}	
 }
\ No newline at end of file
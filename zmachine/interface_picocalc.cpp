@@ -0,0 +1,371 @@
+#include "machine.h"
+#include "interface_picocalc.h"
+
+#include "hal/video.h"
+#include "hal/keyboard.h"
+#include "hal/timer.h"
+#include "fs/volume.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Console on the PicoCalc LCD. Output only lands in a character grid; flush() sends the
+// cells that differ from what's on the panel as drawString runs, so a whole turn of output
+// goes out in a handful of SPI bursts right before we wait for input.
+//
+// The upper window is the LCD's top fixed region and the main window is its scroll region.
+// Cells are stored by panel row ("slot"): upper window rows are slots 0..split-1, and main
+// window row r lives in slot split + (r - split + s_scroll) % mainRows, so scrolling the
+// main window just advances s_scroll and clears one slot, and the panel follows with a
+// single setScroll.
+
+using namespace hal;
+
+static const uint8_t kDefaultFore = 7, kDefaultBack = 0;
+static const uint8_t kNeverShown = 0xFF; // attribute that can't match a real one
+
+static const rgb s_colors[8] = {
+	black, red, green, rgb { 255,255,0 }, blue, rgb { 255,0,255 }, rgb { 0,255,255 }, white
+};
+
+static palette s_palettes[64];	// indexed by attribute, fore << 3 | back
+static char *s_text, *s_shownText;
+static uint8_t *s_attr, *s_shownAttr;
+static uint64_t s_dirty;		// one bit per slot
+static uint8_t s_cols, s_rows, s_split, s_scroll, s_shownScroll;
+static uint8_t s_window, s_x[2], s_y[2];
+static uint8_t s_fore, s_back;
+static bool s_reverse;
+static char s_cacheName[128];
+static fs::directoryEntry s_story;	// for fetching packed pages
+
+static uint8_t mainRows() {
+	return s_rows - s_split;
+}
+
+static uint8_t slotOf(uint8_t row) {
+	return row < s_split? row : s_split + (row - s_split + s_scroll) % mainRows();
+}
+
+static uint8_t currentAttr() {
+	return s_reverse? (s_back << 3) | s_fore : (s_fore << 3) | s_back;
+}
+
+static void clearSlot(uint8_t slot) {
+	memset(s_text + slot * s_cols,' ',s_cols);
+	memset(s_attr + slot * s_cols,currentAttr(),s_cols);
+	s_dirty |= 1ULL << slot;
+}
+
+static void setCell(uint8_t row,uint8_t x,char ch) {
+	uint8_t slot = slotOf(row);
+	uint16_t i = slot * s_cols + x;
+	s_text[i] = ch;
+	s_attr[i] = currentAttr();
+	s_dirty |= 1ULL << slot;
+}
+
+static void newline() {
+	s_x[0] = 0;
+	if (s_y[0] + 1 < s_rows)
+		s_y[0]++;
+	else if (mainRows() > 1) {
+		// the top main row wraps around to become the bottom one
+		uint8_t slot = slotOf(s_split);
+		s_scroll = (s_scroll + 1) % mainRows();
+		clearSlot(slot);
+	}
+	else
+		clearSlot(slotOf(s_y[0]));
+}
+
+static void flush() {
+	uint8_t fw = video::getFontWidth(), fh = video::getFontHeight();
+	if (s_scroll != s_shownScroll) {
+		g_video->setScroll((s_split + s_scroll) * fh);
+		s_shownScroll = s_scroll;
+	}
+	for (uint8_t slot=0; s_dirty; slot++) {
+		if (!(s_dirty & (1ULL << slot)))
+			continue;
+		s_dirty &= ~(1ULL << slot);
+		char *text = s_text + slot * s_cols, *shownText = s_shownText + slot * s_cols;
+		uint8_t *attr = s_attr + slot * s_cols, *shownAttr = s_shownAttr + slot * s_cols;
+		for (uint8_t x=0; x<s_cols;) {
+			if (text[x] == shownText[x] && attr[x] == shownAttr[x]) {
+				x++;
+				continue;
+			}
+			// extend the run over a few unchanged cells rather than paying for another setRegion
+			uint8_t start = x, end = x + 1, a = attr[x];
+			for (++x; x<s_cols && attr[x]==a && x - end < 4; x++)
+				if (text[x] != shownText[x] || attr[x] != shownAttr[x])
+					end = x + 1;
+			g_video->drawString(start * fw,slot * fh,s_palettes[a],text + start,end - start);
+			memcpy(shownText + start,text + start,end - start);
+			memcpy(shownAttr + start,attr + start,end - start);
+			x = end;
+		}
+	}
+}
+
+// cursor blinks like the editor's; only valid right after a flush
+static void drawCursor(bool on) {
+	uint8_t x = s_x[0] < s_cols? s_x[0] : s_cols - 1, slot = slotOf(s_y[0]);
+	uint16_t i = slot * s_cols + x;
+	uint8_t a = s_attr[i];
+	if (on)
+		a = ((a & 7) << 3) | (a >> 3);
+	g_video->drawString(x * video::getFontWidth(),slot * video::getFontHeight(),s_palettes[a],s_text + i,1);
+}
+
+void picocalc::idle() {
+	flush();
+	drawCursor(getUsTime32() & 0x40000);
+}
+
+static uint16_t waitKey() {
+	for (;;) {
+		picocalc::idle();
+		uint16_t ev = g_keyboard->waitKeyEvent(10);
+		if (ev & modifier::PRESSED_BIT)
+			return ev;
+	}
+}
+
+void interface::init(int argc,char **argv) {
+	uint8_t fh = video::getFontHeight();
+	s_cols = video::getScreenWidth() / video::getFontWidth();
+	s_rows = video::getScreenHeight() / fh;
+	if (s_rows > 64)
+		s_rows = 64;
+	delete[] s_text;
+	delete[] s_shownText;
+	delete[] s_attr;
+	delete[] s_shownAttr;
+	uint16_t cells = s_cols * s_rows;
+	s_text = new char[cells];
+	s_shownText = new char[cells];
+	s_attr = new uint8_t[cells];
+	s_shownAttr = new uint8_t[cells];
+	for (uint8_t i=0; i<64; i++)
+		g_video->setColor(s_palettes[i],s_colors[i >> 3],s_colors[i & 7]);
+
+	s_fore = kDefaultFore;
+	s_back = kDefaultBack;
+	s_reverse = false;
+	s_split = s_scroll = s_shownScroll = 0;
+	s_window = 0;
+	s_x[0] = s_y[0] = s_x[1] = s_y[1] = 0;
+	memset(s_text,' ',cells);
+	memset(s_shownText,' ',cells);
+	memset(s_attr,currentAttr(),cells);
+	memset(s_shownAttr,currentAttr(),cells);
+	s_dirty = 0;
+	g_video->fill(0,0,video::getScreenWidth(),video::getScreenHeight(),s_palettes[currentAttr()]);
+	g_video->setFixedRegions(0,video::getScreenHeight() - s_rows * fh);
+	g_video->setScroll(0);
+
+	s_cacheName[0] = 0;
+	if (argc > 1)
+		snprintf(s_cacheName,sizeof(s_cacheName),"%s.tzc",argv[1]);
+}
+
+void interface::putchar(int ch) {
+	if (ch == 13)
+		ch = 10;
+	if (s_window) {
+		if (ch == 10) {
+			s_x[1] = 0;
+			if (s_y[1] + 1 < s_split)
+				s_y[1]++;
+		}
+		else if (s_x[1] < s_cols && s_y[1] < s_split)
+			setCell(s_y[1],s_x[1]++,ch);
+	}
+	else if (ch == 10)
+		newline();
+	else {
+		if (s_x[0] >= s_cols)
+			newline();
+		setCell(s_y[0],s_x[0]++,ch);
+	}
+}
+
+bool picocalc::editLine(uint16_t ev,char *dest,unsigned destSize) {
+	if (!(ev & modifier::PRESSED_BIT))
+		return false;
+	flush();
+	drawCursor(false);
+	unsigned len = strlen(dest);
+	uint8_t ch = uint8_t(ev);
+	if (ch == 10 || ch == 13) {
+		newline();
+		flush();
+		dest[len++] = '\n';
+		dest[len] = 0;
+		return true;
+	}
+	else if (ch == 8 && len) {
+		dest[--len] = 0;
+		if (s_x[0])
+			--s_x[0];
+		else if (s_y[0] > s_split) {
+			--s_y[0];
+			s_x[0] = s_cols - 1;
+		}
+		setCell(s_y[0],s_x[0],' ');
+	}
+	else if (ch >= 32 && ch < 127 && len + 2 < destSize) {
+		dest[len++] = ch;
+		dest[len] = 0;
+		interface::putchar(ch);
+	}
+	return false;
+}
+
+uint8_t picocalc::readChar(uint16_t ev) {
+	if (!(ev & modifier::PRESSED_BIT))
+		return 0;
+	flush();
+	drawCursor(false);
+	uint8_t ch = uint8_t(ev);
+	if (ch >= key::UP && ch <= key::F12)
+		return ch + 1; // 129-144 are the cursor and function keys
+	else if (ch == 10)
+		return 13;
+	else if (ch == 8 || ch == 27 || (ch >= 32 && ch < 127))
+		return ch;
+	return 0;
+}
+
+void interface::readline(char *dest,unsigned destSize) {
+	dest[0] = 0;
+	while (!picocalc::editLine(waitKey(),dest,destSize))
+		;
+}
+
+int interface::readchar() {
+	for (;;)
+		if (uint8_t ch = picocalc::readChar(waitKey()))
+			return ch;
+}
+
+void interface::setTextStyle(uint8_t style) {
+	// bold, italic, and fixed pitch all look the same on this font
+	s_reverse = style & 1;
+}
+
+void interface::setTextColor(uint8_t fore,uint8_t back) {
+	// interpreter colors are current, default, black, red, green, yellow, blue, magenta, cyan, white
+	if (fore == 1)
+		s_fore = kDefaultFore;
+	else if (fore >= 2 && fore <= 9)
+		s_fore = fore - 2;
+	if (back == 1)
+		s_back = kDefaultBack;
+	else if (back >= 2 && back <= 9)
+		s_back = back - 2;
+}
+
+void interface::setWindow(uint8_t w) {
+	s_window = w;
+	if (w)
+		s_x[1] = s_y[1] = 0;
+}
+
+void interface::splitWindow(uint8_t lines) {
+	if (lines >= s_rows)
+		lines = s_rows - 1;
+	if (lines == s_split)
+		return;
+	// the slot layout depends on the split, so lay the screen out again from scratch
+	uint16_t cells = s_cols * s_rows;
+	char *text = new char[cells];
+	uint8_t *attr = new uint8_t[cells];
+	for (uint8_t row=0; row<s_rows; row++) {
+		memcpy(text + row * s_cols,s_text + slotOf(row) * s_cols,s_cols);
+		memcpy(attr + row * s_cols,s_attr + slotOf(row) * s_cols,s_cols);
+	}
+	delete[] s_text;
+	delete[] s_attr;
+	s_text = text;
+	s_attr = attr;
+	memset(s_shownAttr,kNeverShown,cells);
+	s_dirty = ~0ULL >> (64 - s_rows);
+	s_split = lines;
+	s_scroll = s_shownScroll = 0;
+	if (s_y[0] < s_split)
+		s_y[0] = s_split;
+	uint8_t fh = video::getFontHeight();
+	g_video->setFixedRegions(s_split * fh,video::getScreenHeight() - s_rows * fh);
+	g_video->setScroll(s_split * fh);
+}
+
+void interface::eraseWindow(uint8_t cmd) {
+	// cmd is signed in the spec; -1 and -2 clear everything
+	uint8_t first = cmd == 0? s_split : 0, last = cmd == 1? s_split : s_rows;
+	for (uint8_t row=first; row<last; row++)
+		clearSlot(slotOf(row));
+	if (cmd != 1)
+		s_x[0] = 0, s_y[0] = s_split;
+	if (cmd != 0)
+		s_x[1] = s_y[1] = 0;
+}
+
+void interface::setCursor(uint8_t x,uint8_t y) {
+	if (x && y && y <= s_rows) {
+		s_x[s_window] = x - 1;
+		s_y[s_window] = y - 1;
+	}
+}
+
+void interface::updateExtents(uint8_t &width,uint8_t &height) {
+	width = s_cols;
+	height = s_rows;
+}
+
+bool interface::writeSaveData(chunk *,unsigned) {
+	// the FAT volume is read-only
+	return false;
+}
+
+bool interface::readSaveData(chunk *,unsigned) {
+	return false;
+}
+
+bool interface::readCache(void *data,uint32_t size) {
+	fs::directoryEntry de;
+	if (!fs::g_root || !s_cacheName[0] || !fs::g_root->locateEntry(de,s_cacheName) || de.size != size)
+		return false;
+	return fs::g_root->readFile(de,data,0,size) == size;
+}
+
+bool interface::writeCache(const void *,uint32_t) {
+	// the FAT volume is read-only; tinyzc writes the sidecar next to each story it compiles
+	return false;
+}
+
+char* interface::readStory(const char *name,long *sizePtr) {
+	if (!fs::g_root || !fs::g_root->locateEntry(s_story,name))
+		return nullptr;
+	// a packed story's pages stay on the card and are read as the machine pages them in, so
+	// only its header and page offsets take up RAM
+	uint32_t size = s_story.size;
+	packedStory head;
+	if (size >= sizeof(head) && fs::g_root->readFile(s_story,&head,0,sizeof(head)) == sizeof(head) &&
+		packedStory::is(&head) && head.headerSize() <= size)
+		size = head.headerSize();
+	char *story = new char[size];
+	if (fs::g_root->readFile(s_story,story,0,size) != size) {
+		delete[] story;
+		return nullptr;
+	}
+	if (sizePtr)
+		*sizePtr = size;
+	return story;
+}
+
+bool interface::readStoryPart(void *dest,uint32_t offset,uint32_t size) {
+	return fs::g_root && fs::g_root->readFile(s_story,dest,offset,size) == size;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// The PicoCalc console's input a key event at a time, for firmware that drives a machine with
+// step() from its own loop instead of blocking in machine::run. interface::readline and
+// interface::readchar are built on the same calls.
+namespace picocalc {
+
+// puts what the story printed on the panel and blinks the cursor; call while it waits for input
+void idle();
+
+// applies a key event to the line being read into dest, which starts out empty and stays
+// NUL-terminated; returns true once Enter has finished it, newline included
+bool editLine(uint16_t ev,char *dest,unsigned destSize);
+
+// the character read_char gets for a key event, or 0 if it doesn't make one
+uint8_t readChar(uint16_t ev);
+
+} // namespace picocalc
@@ -1,27 +1,176 @@
 #include "machine.h"
 #include "opcodes.h"
 
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
 
 #define HEIGHT 0x20
 #define WIDTH 0x21
 
-void machine::init(const void *data,bool debug) {
-	uint8_t version = *(uint8_t*)data;
+static int32_t random_seed = 0;
+static int randomNumber(void) {
+	// borrowed from mojozork so I can use that project's validation script
+    // this is POSIX.1-2001's potentially bad suggestion, but we're not exactly doing cryptography here.
+    random_seed = random_seed * 1103515245 + 12345;
+    return (int) ((unsigned int) (random_seed / 65536) % 32768);
+}
+
+machine::machine(uint16_t stackSize,uint16_t undoSize) : m_dynamic(nullptr), m_stack(nullptr), m_undoBuffer(nullptr),
+	m_fallbackStackSize(stackSize), m_maxUndoSize(undoSize) {
+	// init can fault on a damaged story before there's any instruction to blame
+	m_faultJmp = nullptr;
+	m_faultpc = 0;
+#if ENABLE_OBJECT_SHADOW
+	m_objParent = nullptr;
+	m_objAttr = nullptr;
+#endif
+#if ENABLE_PACKED_STORY
+	m_pageCache = m_pageBuffer = nullptr;
+#endif
+#if ENABLE_PROFILE
+	m_profile = nullptr;
+#endif
+}
+
+machine::~machine() {
+	delete[] m_dynamic;
+	delete[] m_stack;
+	delete[] m_undoBuffer;
+#if ENABLE_OBJECT_SHADOW
+	delete[] m_objParent;
+	delete[] m_objAttr;
+#endif
+#if ENABLE_PACKED_STORY
+	delete[] m_pageCache;
+	delete[] m_pageBuffer;
+#endif
+#if ENABLE_PROFILE
+	delete m_profile;
+#endif
+}
+
+#if ENABLE_PACKED_STORY
+void ZM_HOT_FUNC(machine::pageIn)(uint32_t addr) const {
+	if (!m_packed)
+		memfault("out of range address %x (highest is %x)",addr,m_readOnlySize);
+	uint16_t page = addr >> m_packed->pageShift;
+	if (page >= m_packed->pageCount)
+		memfault("out of range address %x (highest is %x)",addr,m_packed->storySize - 1);
+	uint8_t slot = kPageCacheSize, oldest = 0;
+	for (uint8_t i=0; i<kPageCacheSize; i++) {
+		if (m_cachedPage[i] == page)
+			slot = i;
+		if (m_cacheAge[i] > m_cacheAge[oldest])
+			oldest = i;
+		if (m_cacheAge[i] < 255)
+			m_cacheAge[i]++;
+	}
+	if (slot == kPageCacheSize) {
+		slot = oldest;
+		m_cachedPage[slot] = page;
+		if (m_pageBuffer && !interface::readStoryPart(m_pageBuffer,m_packed->pageOffsets[page],m_packed->storedBytes(page))) {
+			m_cachedPage[slot] = 0xFFFF;
+			memfault("unable to read page %d of the story",page);
+		}
+		if (m_packed->unpackPage(page,m_pageCache + (slot << m_packed->pageShift),m_pageBuffer) != m_packed->pageBytes(page)) {
+			m_cachedPage[slot] = 0xFFFF;
+			memfault("page %d of the story is damaged",page);
+		}
+	}
+	m_cacheAge[slot] = 0;
+	m_window = m_pageCache + (slot << m_packed->pageShift);
+	m_windowStart = (uint32_t)page << m_packed->pageShift;
+	m_windowSize = m_packed->storySize - m_windowStart < m_packed->pageSize()? m_packed->storySize - m_windowStart : m_packed->pageSize();
+}
+
+void machine::copyStory(void *dest,uint32_t addr,uint32_t size) const {
+	uint8_t *d = (uint8_t*) dest;
+	while (size) {
+		uint32_t offset = addr - m_windowStart;
+		if (offset >= m_windowSize) {
+			pageIn(addr);
+			offset = addr - m_windowStart;
+		}
+		uint32_t count = m_windowSize - offset < size? m_windowSize - offset : size;
+		memcpy(d,m_window + offset,count);
+		d += count;
+		addr += count;
+		size -= count;
+	}
+}
+#else
+void machine::copyStory(void *dest,uint32_t addr,uint32_t size) const {
+	memcpy(dest,m_readOnly + addr,size);
+}
+#endif
+
+// puts dynamic memory back the way the story started it
+void machine::resetDynamic() {
+#if ENABLE_DIRTY_PAGES
+	const uint32_t pageSize = 1 << kDirtyPageShift;
+	for (uint32_t i=0; i<sizeof(m_dirtyPages); i++) {
+		if (!m_dirtyPages[i])
+			continue;
+		for (uint32_t addr = i << (kDirtyPageShift + 3); addr < ((i + 1) << (kDirtyPageShift + 3)) && addr < m_dynamicSize; addr += pageSize)
+			if (isDirty(addr))
+				copyStory(m_dynamic + addr,addr,m_dynamicSize - addr < pageSize? m_dynamicSize - addr : pageSize);
+		m_dirtyPages[i] = 0;
+	}
+	// the header is written by the interpreter and the globals through ref and var, neither of
+	// which is worth tracking, so those are always dirty
+	markDirty(0,sizeof(storyHeader));
+	markDirty(m_globalsOffset,240*2);
+#else
+	copyStory(m_dynamic,0,m_dynamicSize);
+#endif
+}
+
+void machine::init(const void *data,uint32_t size,bool debug) {
+#if ENABLE_PACKED_STORY
+	m_packed = size >= sizeof(packedStory) && packedStory::is(data)? (const packedStory*) data : nullptr;
+	if (m_packed) {
+		// pageIn trusts the page offsets, so they're checked once here
+		if (size < m_packed->headerSize() || !m_packed->valid()) {
+			printf("packed story is damaged\n");
+			exit(1);
+		}
+		m_readOnly = nullptr;
+		m_readOnlySize = m_packed->storySize;
+		m_pageCache = new uint8_t[kPageCacheSize << m_packed->pageShift];
+		m_pageBuffer = size < m_packed->packedSize()? new uint8_t[m_packed->pageSize()] : nullptr;
+		memset(m_cachedPage,0xFF,sizeof(m_cachedPage));
+		memset(m_cacheAge,0,sizeof(m_cacheAge));
+		m_window = nullptr;
+		m_windowStart = m_windowSize = 0;
+	}
+	else {
+		// the whole story is one big window, trimmed once the header tells us its length
+		m_readOnly = (const uint8_t*) data;
+		m_readOnlySize = size;
+		m_window = m_readOnly;
+		m_windowStart = 0;
+		m_windowSize = size;
+	}
+#else
+	m_readOnly = (const uint8_t*) data;
+#endif
+	uint8_t version = readOnly8(0);
 	if (version > 8 || !((1<<version) & (0b1'1011'1000))) {
 		printf("only versions 3,4,5,7,8 supported\n");
 		exit(1);
 	}
 	m_storyShift = version==3? 1 : version<=7? 2 : 3; 
 	m_sp = m_lp = 0;
-	m_readOnly = (const uint8_t*) data;
-	m_dynamicSize = m_header->staticMemoryAddr.getU();
+	m_dynamicSize = readOnly16(offsetof(storyHeader,staticMemoryAddr)).getU();
 	m_dynamic = new uint8_t[m_dynamicSize];
-	memcpy(m_dynamic, m_readOnly, m_dynamicSize);
+	copyStory(m_dynamic,0,m_dynamicSize);
+	m_header = (const storyHeader*)(m_readOnly? m_readOnly : m_dynamic);
 	if (version==3)
 		m_dynamic[1] |= 32; // screen splitting available
 	else if (version>=5)
@@ -34,19 +183,72 @@ void machine::init(const void *data,bool debug) {
 		m_routinesOffset = m_staticStringOffset = 0;
 
 	m_globalsOffset = m_header->globalVarsTableAddr.getU();
+	m_globals = (word*)(m_dynamic + m_globalsOffset);
+#if ENABLE_DIRTY_PAGES
+	// all of it was just copied, so this only marks the pages that are always dirty
+	memset(m_dirtyPages,0,sizeof(m_dirtyPages));
+	resetDynamic();
+#endif
 	m_abbreviations = m_header->abbreviationsAddr.getU();
 	m_readOnlySize = m_header->storyLength.getU() << (m_storyShift + (version==6||version==7));
-	memcpy(m_zscii,
-		version>=5 && m_header->alphabetTableAddress.getU()? 
-			(const char*)m_readOnly + m_header->alphabetTableAddress.getU() :
-			DEFAULT_ZSCII_ALPHABET,
-		26*3);
+	// size the stack from the story's own worst case where that's decidable; push, call and ref
+	// fault rather than run past it, whichever size it ends up.
+	bool fromCache;
+#if ENABLE_PACKED_STORY
+	if (m_packed) {
+		// packing analyzed the story while it was still whole
+		m_analysis = m_packed->analysis;
+		// the header's length is rounded up, or could be anything in a hand-made container
+		if (m_readOnlySize > m_packed->storySize)
+			m_readOnlySize = m_packed->storySize;
+		fromCache = true;
+	}
+	else {
+		if (m_readOnlySize > size)
+			m_readOnlySize = size;
+		m_windowSize = m_readOnlySize;
+#else
+	{
+#endif
+		analysisCache expected, cached;
+		expected.describe(m_readOnly,m_readOnlySize);
+		fromCache = interface::readCache(&cached,sizeof(cached)) && cached.matches(expected);
+		if (fromCache)
+			m_analysis = cached.analysis;
+		else {
+			analyzeStory(m_readOnly,m_readOnlySize,m_analysis);
+			expected.analysis = m_analysis;
+			interface::writeCache(&expected,sizeof(expected));
+		}
+	}
+	m_stackSize = m_analysis.maxStack && m_analysis.maxStack <= 8191? m_analysis.maxStack : m_fallbackStackSize;
+	m_undoSize = m_analysis.usesUndo? m_maxUndoSize : 0;
+	m_stack = new word[m_stackSize];
+	m_undoBuffer = m_undoSize? new uint8_t[m_undoSize] : nullptr;
+	if (version>=5 && m_header->alphabetTableAddress.getU())
+		copyStory(m_zscii,m_header->alphabetTableAddress.getU(),26*3);
+	else
+		memcpy(m_zscii,DEFAULT_ZSCII_ALPHABET,26*3);
 	m_objectSmall = (object_header_small*) (m_dynamic + m_header->objectTableAddr.getU());
 	m_objCount = m_header->version<4
 		? (m_objectSmall->objTable[0].propAddr.getU() - (m_header->objectTableAddr.getU() + 31*2))/9
 		: (m_objectLarge->objTable[0].propAddr.getU() - (m_header->objectTableAddr.getU() + 63*2))/14;
+	m_objEntries = m_header->objectTableAddr.getU() + (m_header->version<4? 31*2 : 63*2);
+	m_objEntrySize = m_header->version<4? 9 : 14;
+	m_objEntriesSize = m_objCount * m_objEntrySize;
+#if ENABLE_OBJECT_SHADOW
+	m_objParent = new uint16_t[(m_objCount + 1) * 4];
+	m_objSibling = m_objParent + m_objCount + 1;
+	m_objChild = m_objSibling + m_objCount + 1;
+	m_objProps = m_objChild + m_objCount + 1;
+	m_objAttr = new uint64_t[m_objCount + 1];
+	loadObjects();
+#endif
 #if ENABLE_DEBUG
 	if (debug) {
+		printf("%d routines, stack %d words (analysis %s%s, %d deep, largest frame %d), undo %d bytes\n",
+			m_analysis.routineCount,m_stackSize,m_analysis.maxStack? "exact" : "inconclusive",fromCache? " from cache" : "",
+			m_analysis.maxCallDepth,m_analysis.maxFrame,m_undoSize);
 		printf("%d objects detected in story\n",m_objCount);
 		printObjTree();
 	}
@@ -56,15 +258,38 @@ void machine::init(const void *data,bool debug) {
 	m_debug = debug;
 #endif
 	m_windowSplit = m_header->version < 4;
+	interface::splitWindow(m_windowSplit);
 	m_currentWindow = 0;
 	m_outputEnables = 3; // buffering enabled in window 0, stream 1 enabled
 	m_cursorX = m_cursorY = 1;
 	m_printed = 0;
 	m_stored = 0;
+	m_statusLine.valid = false;
 	m_undoTop = 0;
-	run(m_header->initialPCAddr.getU());
+	m_pc = m_header->initialPCAddr.getU();
+	m_status = m_resume = status::running;
+	m_faultJmp = nullptr;
+	random_seed = 2;
+	m_dict.addr = 0;
+#if ENABLE_TRACE
+	memset(m_trace,0,sizeof(m_trace));
+	m_traceNext = 0;
+#endif
 }
 
+#if ENABLE_PROFILE
+void machine::startProfile() {
+	if (!m_profile)
+		m_profile = new std::unordered_map<uint32_t,uint32_t>;
+}
+
+void machine::writeProfile(FILE *f) const {
+	if (m_profile)
+		for (auto &p: *m_profile)
+			fprintf(f,"%x %u\n",p.first,p.second);
+}
+#endif
+
 #if ENABLE_DEBUG
 void machine::printObjTree() {
 	auto prev = m_outputEnables;
@@ -78,7 +303,63 @@ void machine::printObjTree() {
 }
 #endif
 
-void machine::finishChar(uint8_t c) {
+#if ENABLE_OBJECT_SHADOW
+void machine::loadObjects() {
+	for (uint16_t o=1; o<=m_objCount; o++)
+		loadObject(o);
+	m_objDirty = false;
+}
+
+void ZM_HOT_FUNC(machine::loadObject)(uint16_t o) {
+	const uint8_t *attr;
+	if (m_header->version < 4) {
+		const object_small &e = m_objectSmall->objTable[o-1];
+		m_objParent[o] = e.parent;
+		m_objSibling[o] = e.sibling;
+		m_objChild[o] = e.child;
+		m_objProps[o] = e.propAddr.getU();
+		attr = e.attr;
+	}
+	else {
+		const object_large &e = m_objectLarge->objTable[o-1];
+		m_objParent[o] = e.parent.getU();
+		m_objSibling[o] = e.sibling.getU();
+		m_objChild[o] = e.child.getU();
+		m_objProps[o] = e.propAddr.getU();
+		attr = e.attr;
+	}
+	uint64_t a = 0;
+	for (int i=0; i<(m_header->version<4? 4 : 6); i++)
+		a |= (uint64_t)attr[i] << (56 - i*8);
+	m_objAttr[o] = a;
+}
+
+void ZM_HOT_FUNC(machine::flushObjects)() const {
+	markDirty(m_objEntries,m_objEntriesSize);
+	for (uint16_t o=1; o<=m_objCount; o++) {
+		uint8_t *attr;
+		if (m_header->version < 4) {
+			object_small &e = m_objectSmall->objTable[o-1];
+			e.parent = m_objParent[o];
+			e.sibling = m_objSibling[o];
+			e.child = m_objChild[o];
+			attr = e.attr;
+		}
+		else {
+			object_large &e = m_objectLarge->objTable[o-1];
+			e.parent.set(m_objParent[o]);
+			e.sibling.set(m_objSibling[o]);
+			e.child.set(m_objChild[o]);
+			attr = e.attr;
+		}
+		for (int i=0; i<(m_header->version<4? 4 : 6); i++)
+			attr[i] = m_objAttr[o] >> (56 - i*8);
+	}
+	m_objDirty = false;
+}
+#endif
+
+void ZM_HOT_FUNC(machine::finishChar)(uint8_t c) {
 	if (c == 10) {
 		m_cursorX = 1;
 		if (m_currentWindow==1 && m_cursorY < m_windowSplit)
@@ -99,12 +380,13 @@ void machine::flushMainWindow() {
 	}
 }
 
-void machine::print_char(uint8_t c) {
+void ZM_HOT_FUNC(machine::print_char)(uint8_t c) {
 	if (!c)
 		return;
 	if (m_outputEnables & (1 << 3)) {
 		word *cp = (word*)(m_dynamic + m_outputBuffer);
 		write_mem8(m_outputBuffer + 2 + cp->getU(),c);
+		markDirty(m_outputBuffer,2);
 		cp->inc();
 	}	
 	else if (m_outputEnables & (1 << 1)) {
@@ -141,7 +423,7 @@ void machine::print_num(int16_t v) {
 		print_char(*b++);
 }
 
-uint32_t machine::call(uint32_t pc,int storage,word operands[],uint8_t opCount) {
+uint32_t ZM_HOT_FUNC(machine::call)(uint32_t pc,int storage,word operands[],uint8_t opCount) {
 	if (!opCount)
 		fault("impossible call with no address");
 	uint32_t newPc = m_routinesOffset + (operands[0].getU() << m_storyShift);
@@ -153,13 +435,17 @@ uint32_t machine::call(uint32_t pc,int storage,word operands[],uint8_t opCount)
 			ref(storage,true).setByte(0);
 		return pc;
 	}
+#if ENABLE_PROFILE
+	if (m_profile)
+		++(*m_profile)[newPc];
+#endif
 	uint8_t localCount = read_mem8(newPc++);
 	uint8_t larger = localCount > opCount? localCount : opCount;
-	if (m_sp + larger + 3 > kStackSize)
+	if (m_sp + larger + 3 > m_stackSize)
 		fault("stack overflow in routine call");
 	word *frame = m_stack + m_sp;
 	if (m_header->version < 5) { // there are N initial values for locals here
-		memcpy(frame+3,m_readOnly + newPc,localCount<<1);
+		copyStory(frame+3,newPc,localCount<<1);
 		newPc += localCount<<1;
 	}
 	else // the values are always zero
@@ -177,14 +463,14 @@ uint32_t machine::call(uint32_t pc,int storage,word operands[],uint8_t opCount)
 	return newPc;
 }
 
-uint32_t machine::r_return(uint16_t v) {
+uint32_t ZM_HOT_FUNC(machine::r_return)(uint16_t v) {
 #if ENABLE_DEBUG
 	if (m_debug > 1)
 		printf("returning %04x to caller, sp now %03x; ",v,m_lp);
 #endif
 		m_sp = m_lp;
 	int32_t pc = m_stack[m_sp].getU() | ((m_stack[m_sp+1].getU() >> 13) << 16);
-	m_lp = m_stack[m_sp+1].getU() & (kStackSize-1);
+	m_lp = m_stack[m_sp+1].getU() & 0x1FFF;
 	int addr = m_stack[m_sp+2].getS() >> 5;
 #if ENABLE_DEBUG
 	if (m_debug > 1)
@@ -195,7 +481,7 @@ uint32_t machine::r_return(uint16_t v) {
 	return pc;
 }
 
-void machine::printz(uint8_t ch) {
+void ZM_HOT_FUNC(machine::printz)(uint8_t ch) {
 	if (ch>=32)
 		fault("invalid zchar %d",ch);
 	if (m_abbrev) {
@@ -225,7 +511,7 @@ void machine::printz(uint8_t ch) {
 	}
 }
 
-uint32_t machine::print_zscii(uint32_t addr) {
+uint32_t ZM_HOT_FUNC(machine::print_zscii)(uint32_t addr) {
 	uint16_t w;
 	m_abbrev = 0;
 	m_extended = 0;
@@ -248,6 +534,11 @@ void machine::fault(const char *fmt,...) const {
 	vprintf(fmt,args);
 	printf("\n");
 	va_end(args);
+#if ENABLE_TRACE
+	dumpTrace();
+#endif
+	if (m_faultJmp)
+		longjmp(*m_faultJmp,1);
 	exit(1);
 }
 
@@ -258,9 +549,26 @@ void machine::memfault(const char *fmt,...) const {
 	vprintf(fmt,args);
 	printf("\n");
 	va_end(args);
+#if ENABLE_TRACE
+	dumpTrace();
+#endif
+	if (m_faultJmp)
+		longjmp(*m_faultJmp,1);
 	exit(1);
 }
 
+#if ENABLE_TRACE
+// one line per record, oldest first; zdis -trace decodes these against the story
+void machine::dumpTrace() const {
+	printf("trace:\n");
+	for (uint16_t i=0; i<kTraceSize; i++) {
+		const traceRecord &t = m_trace[(m_traceNext + i) & (kTraceSize-1)];
+		if (t.pc)
+			printf("T %06x %04x %04x %04x %04x\n",t.pc,t.opcode,t.operands[0],t.operands[1],t.result);
+	}
+}
+#endif
+
 void machine::updateExtents() {
 	interface::updateExtents(m_dynamic[WIDTH],m_dynamic[HEIGHT]);
 
@@ -277,24 +585,25 @@ void machine::showStatus() {
 		m_header->version > 3)
 		return;
 	uint16_t globals = m_header->globalVarsTableAddr.getU();
-	flushMainWindow();
+	statusLine now = { read_mem16(globals).getU(), read_mem16(globals+4).getU(), read_mem16(globals+2).getS(),
+		read_mem8(WIDTH), read_mem8(HEIGHT), true };
+	if (m_statusLine.valid && now.location == m_statusLine.location && now.moves == m_statusLine.moves &&
+		now.score == m_statusLine.score && now.width == m_statusLine.width && now.height == m_statusLine.height)
+		return;
+	m_statusLine = now;
+	// the backend flushes when it waits for input, so a redraw goes out with the rest of the turn
 	setWindow(1);
 	interface::setTextStyle(1);
 	m_printed = 0;
-	objPrint(read_mem16(globals).getU());
-	uint8_t screenWidth = read_mem8(WIDTH);
-	int16_t score = read_mem16(globals+2).getS();
-	uint16_t moves = read_mem16(globals+4).getU();
+	objPrint(now.location);
 	char scoreBuf[16];
-	snprintf(scoreBuf,16,"%d/%d",score,moves);
-	screenWidth -= strlen(scoreBuf);
-	while (m_printed < screenWidth)
-		print_char(' ');
-	for (int i=0; i<16 && scoreBuf[i]; i++)
+	int scoreLength = snprintf(scoreBuf,sizeof(scoreBuf),"%d/%d",now.score,now.moves);
+	for (; m_printed < now.width - scoreLength; m_printed++)
+		interface::putchar(' ');
+	for (int i=0; i<scoreLength; i++)
 		interface::putchar(scoreBuf[i]);
 	interface::setTextStyle(0);
 	setWindow(0);
-	fflush(stdout);
 }
 
 void machine::setWindow(uint8_t window) {
@@ -334,14 +643,6 @@ void machine::setOutput(int enable,uint16_t tableAddr) {
 		m_outputEnables &= ~(1 << -enable);
 }
 
-static int32_t random_seed = 0;
-static int randomNumber(void) {
-	// borrowed from mojozork so I can use that project's validation script
-    // this is POSIX.1-2001's potentially bad suggestion, but we're not exactly doing cryptography here.
-    random_seed = random_seed * 1103515245 + 12345;
-    return (int) ((unsigned int) (random_seed / 65536) % 32768);
-}
-
 void machine::encode_text(word dest[],const char *src,uint8_t len) {
 	int maxStore = m_header->version>=4? 9 : 6, stored = 0;
 	auto store = [&](uint8_t c) {
@@ -380,39 +681,75 @@ void machine::encode_text(word dest[],const char *src,uint8_t len) {
 	last.set(last.getU() | 0x8000);
 }
 
+void machine::provideLine(const char *line) {
+	if (m_status != status::needs_line)
+		return;
+	strncpy(m_input,line,sizeof(m_input)-1);
+	m_input[sizeof(m_input)-1] = 0;
+	m_resume = status::needs_line;
+	m_status = status::running;
+}
+
+void machine::provideChar(uint8_t ch) {
+	if (m_status != status::needs_char)
+		return;
+	m_input[0] = ch;
+	m_resume = status::needs_char;
+	m_status = status::running;
+}
+
+// finish the sread or read_char that suspended the last step now that the host supplied input
+void machine::resume() {
+	status what = m_resume;
+	m_resume = status::running;
+	if (what == status::needs_char)
+		ref(m_inputDest,true).setByte(m_input[0]);
+	else {
+		uint8_t terminator = read_input(m_inputText,m_inputParse);
+		if (!terminator)
+			m_status = status::needs_line;
+		else if (m_header->version>=5)
+			ref(m_inputDest,true).setByte(terminator);
+	}
+}
+
+static void copyLower(uint8_t *dest,const char *src,uint8_t len) {
+	while (len--) {
+		char ch = *src++;
+		*dest++ = ch>='A'&&ch<='Z'? ch + 32 : ch;
+	}
+}
+
+// returns zero if the line was consumed internally and the host should be asked for another one
 uint8_t machine::read_input(uint16_t textAddr,uint16_t parseAddr) {
-	char buffer[256];
-	bool internal;
-	flushMainWindow();
-	do {
-		interface::readline(buffer,sizeof(buffer));
-		while (strlen(buffer) && buffer[strlen(buffer)-1]==10)
-			buffer[strlen(buffer)-1] = 0;
-		// printf("[[%s]]\n",buffer);
-		for (char *t = buffer; *t; t++)
-			if (*t>='A'&&*t<='Z') 
-				*t +=32; 
-		internal = false;
-		if (!strncmp(buffer,"#random ",8)) {
-			random_seed = atoi(buffer+9);
-			printf("{random_seed set to %d}\n",random_seed);
-			internal = true;
-		}
+	char *buffer = m_input;
+	size_t len = strlen(buffer);
+	while (len && buffer[len-1]==10)
+		buffer[--len] = 0;
+	// printf("[[%s]]\n",buffer);
+	if (len >= 240)
+		return 0;
+	// the text is lowercased on its way into the story's buffer, so these have to ignore case
+	if (!strncasecmp(buffer,"#random ",8)) {
+		random_seed = atoi(buffer+9);
+		printf("{random_seed set to %d}\n",random_seed);
+		return 0;
+	}
 #if ENABLE_DEBUG
-		else if (!strncmp(buffer,"#objtree",8)) {
-			printObjTree();
-			internal = true;
-		}
+	else if (!strncasecmp(buffer,"#objtree",8)) {
+		printObjTree();
+		return 0;
+	}
 #endif
-	} while (strlen(buffer) >= 240 || internal);
-	uint8_t sl = strlen(buffer), offset;
+	uint8_t sl = len, offset;
 	if (m_header->version < 5) {
 		uint8_t s = read_mem8(textAddr);
 		if (sl > s-1)
 			sl = s-1;
 		if (textAddr + 1 + s - 1 > m_dynamicSize)
 			fault("read_input (v1-4) past dynamic memory");
-		memcpy(m_dynamic + textAddr + 1,buffer,sl);
+		markDirty(textAddr + 1,sl);
+		copyLower(m_dynamic + textAddr + 1,buffer,sl);
 		write_mem8(textAddr + 1 + sl,0);
 		//printf("{{read [%*.*s]}}\n",sl,sl,m_dynamic+textAddr+1);
 		offset = 1;
@@ -424,10 +761,11 @@ uint8_t machine::read_input(uint16_t textAddr,uint16_t parseAddr) {
 			printf("{{%d inputs bytes already there}}\n",soFar); */
 		if (sl > s - soFar)
 			sl = s - soFar;
-		m_dynamic[textAddr+1] = sl;
 		if (textAddr + 2 + soFar + sl > m_dynamicSize)
 			fault("read_input (v5+) past dynamic memory");
-		memcpy(m_dynamic + textAddr + 2 + soFar,buffer,sl);
+		markDirty(textAddr + 1,1 + soFar + sl);
+		m_dynamic[textAddr+1] = sl;
+		copyLower(m_dynamic + textAddr + 2 + soFar,buffer,sl);
 		// printf("{{read [%*.*s]}}\n",sl,sl,m_dynamic+textAddr+2);
 		offset = 2;
 	}
@@ -437,53 +775,89 @@ uint8_t machine::read_input(uint16_t textAddr,uint16_t parseAddr) {
 		return 13;
 }
 
-uint8_t machine::tokenise(uint16_t textAddr,uint16_t parseAddr,uint8_t offset) {
-	uint16_t dictAddr = m_header->dictionaryAddr.getU();
+void machine::useDictionary(uint16_t addr) {
+	m_dict.addr = addr;
 	// the separators are actually stored as parsed words. spaces are not.
-	uint8_t numSeparators = read_mem8(dictAddr++);
-	uint16_t separators = dictAddr;
-	dictAddr += numSeparators;
-	uint8_t entryLength = read_mem8(dictAddr++);
-	uint16_t numWords = read_mem16(dictAddr).getU();
-	dictAddr+=2;
-	uint8_t sl = m_header->version<5? strlen((char*)m_dynamic+textAddr+1) : m_dynamic[textAddr+1];
+	uint8_t numSeparators = read_mem8(addr++);
+	memset(m_dict.separators,0,sizeof(m_dict.separators));
+	while (numSeparators--) {
+		uint8_t ch = read_mem8(addr++);
+		m_dict.separators[ch >> 5] |= 1U << (ch & 31);
+	}
+	m_dict.entryLength = read_mem8(addr++);
+	m_dict.count = read_mem16(addr).getS();
+	m_dict.entries = addr + 2;
+}
+
+uint8_t machine::tokenise(uint16_t textAddr,uint16_t parseAddr,uint8_t offset,uint16_t dictAddr,bool keepUnknown) {
+	if (!dictAddr)
+		dictAddr = m_header->dictionaryAddr.getU();
+	if (dictAddr != m_dict.addr)
+		useDictionary(dictAddr);
+	uint8_t sl;
+	if (m_header->version<5) {
+		// zero terminated, but never longer than the buffer
+		uint8_t max = read_mem8(textAddr);
+		if (textAddr + 1 + max > m_dynamicSize)
+			fault("tokenise (v1-4) past dynamic memory");
+		const uint8_t *end = (const uint8_t*) memchr(m_dynamic + textAddr + 1,0,max);
+		sl = end? end - (m_dynamic + textAddr + 1) : max;
+	}
+	else
+		sl = read_mem8(textAddr+1);
 	uint8_t stop = offset + sl;
+	if (textAddr + stop > m_dynamicSize)
+		fault("tokenise past dynamic memory");
+	const uint8_t *text = m_dynamic + textAddr;
 	uint8_t maxParsed = read_mem8(parseAddr);
 	uint8_t numParsed = 0;
-	//printf("{{%d separators, %d words, %d bytes per entry}}\n",numSeparators,numWords,entryLength)
+	uint8_t keyLength = m_header->version<5? 4 : 6;
+	//printf("{{%d words, %d bytes per entry}}\n",m_dict.count,m_dict.entryLength)
 	// printf("{{offset=%d,stop=%d}}\n",offset,stop);
 	while (offset < stop && numParsed < maxParsed) {
-		// printf("{{offset=%d}}\n",offset);
-		// skip spaces
-		while (m_dynamic[textAddr+offset] == 32 && offset<stop)
+		uint8_t ch = text[offset];
+		if (ch == 32) {
 			++offset;
-		if (offset==stop)
-			break;
-		uint8_t wordLen = 1;
-		// if it's not a word separator, keep looking until we get to end, space, or a word separator
-		if (!memchr(m_dynamic + separators,m_dynamic[textAddr+offset],numSeparators)) {
-			while (offset+wordLen < stop && m_dynamic[textAddr+offset+wordLen]!=32 && 
-					!memchr(m_dynamic + separators,m_dynamic[textAddr+offset+wordLen],numSeparators))
-				++wordLen;
+			continue;
 		}
+		// a separator is a word by itself, anything else runs to the next space or separator
+		uint8_t start = offset++;
+		if (!m_dict.isSeparator(ch))
+			while (offset < stop && text[offset] != 32 && !m_dict.isSeparator(text[offset]))
+				++offset;
+		uint8_t wordLen = offset - start;
 		word zword[3];
-		// printf("{{encoding %*.*s}}\n",wordLen,wordLen,m_dynamic+textAddr+offset);
-		encode_text(zword,(char*)m_dynamic + textAddr + offset,wordLen);
+		// printf("{{encoding %*.*s}}\n",wordLen,wordLen,text+start);
+		encode_text(zword,(const char*)text + start,wordLen);
 		// printf("{{%04x,%04x}}\n",zword[0].getU(),zword[1].getU());
-		void *result = bsearch(zword,m_readOnly + dictAddr,numWords,entryLength,
-			m_header->version<5? 
-				[](const void *a,const void *b) { return memcmp(a,b,4); } : 
-				[](const void *a,const void *b) { return memcmp(a,b,6); });
-
-		if (!result)
-			write_mem16(parseAddr+2+numParsed*4,byte2word(0));
-		else
-			write_mem16(parseAddr+2+numParsed*4,word2word((const uint8_t*)result - m_readOnly));
-		write_mem8(parseAddr+2+numParsed*4+2,wordLen);
-		write_mem8(parseAddr+2+numParsed*4+3,offset);
+		// a byte at a time, since the dictionary may only be reachable a page at a time
+		const uint8_t *key = (const uint8_t*) zword;
+		uint16_t result = 0;
+		int32_t low = 0, high = (m_dict.count < 0? -m_dict.count : m_dict.count) - 1;
+		while (low <= high) {
+			int32_t mid = m_dict.count < 0? low : (low + high) >> 1;
+			uint16_t entry = m_dict.entries + mid * m_dict.entryLength;
+			int diff = 0;
+			for (uint8_t i=0; i<keyLength && !diff; i++)
+				diff = key[i] - read_mem8(entry + i);
+			if (!diff) {
+				result = entry;
+				break;
+			}
+			else if (m_dict.count < 0)	// unsorted, so just walk it
+				low = mid + 1;
+			else if (diff < 0)
+				high = mid - 1;
+			else
+				low = mid + 1;
+		}
+		if (result || !keepUnknown) {
+			write_mem16(parseAddr+2+numParsed*4,word2word(result));
+			write_mem8(parseAddr+2+numParsed*4+2,wordLen);
+			write_mem8(parseAddr+2+numParsed*4+3,start);
+		}
 		/* printf("{{%02x%02x%02x%02x}}\n",m_dynamic[parseAddr+2+numParsed*4],m_dynamic[parseAddr+2+numParsed*4+1],
 			m_dynamic[parseAddr+2+numParsed*4+2],m_dynamic[parseAddr+2+numParsed*4+3]); */
-		offset += wordLen;
 		++numParsed;
 	}
 	write_mem8(parseAddr+1,numParsed);
@@ -520,6 +894,10 @@ void machine::copyTable(uint16_t first,uint16_t second,int16_t count) {
 }
 
 uint16_t machine::encodeDelta(uint32_t pc,uint8_t *buffer) {
+#if ENABLE_OBJECT_SHADOW
+	if (m_objDirty)
+		flushObjects();
+#endif
 	uint16_t outSize = 0;
 	if (buffer) {
 		buffer[0] = pc >> 24;
@@ -535,14 +913,22 @@ uint16_t machine::encodeDelta(uint32_t pc,uint8_t *buffer) {
 		buffer += 8 + m_sp + m_sp;
 	}
 	outSize += 4 + 2 + 2 + m_sp + m_sp;
-	uint16_t start = 0;
+	uint32_t start = 0;
 	for (;;) {
-		while (start < m_dynamicSize && m_dynamic[start]==m_readOnly[start])
-			++start;
+		while (start < m_dynamicSize) {
+			if (!isDirty(start))
+				start = (start | ((1 << kDirtyPageShift) - 1)) + 1;
+			else if (m_dynamic[start]==readOnly8(start))
+				++start;
+			else
+				break;
+		}
+		if (start > m_dynamicSize)
+			start = m_dynamicSize;
 		if (start == m_dynamicSize)
 			break;
 		uint32_t end = start;
-		while (end < m_dynamicSize && m_dynamic[end]!=m_readOnly[end])
+		while (end < m_dynamicSize && m_dynamic[end]!=readOnly8(end))
 			++end;
 		uint16_t runLength = end-start;
 		// printf("{encode offset %d count %d}\n",start,runLength);
@@ -574,38 +960,70 @@ uint32_t machine::applyDelta(const uint8_t *buffer) {
 	m_lp = (buffer[6] << 8) | buffer[7];
 	memcpy(m_stack,buffer + 8,m_sp + m_sp);
 	buffer += 8 + m_sp + m_sp;
-	memcpy(m_dynamic,m_readOnly,m_dynamicSize);
-	do {
+	resetDynamic();
+	// nothing but the terminator if dynamic memory was untouched
+	while (buffer[0]!=0xFF || buffer[1]!=0xFF) {
 		uint16_t offset = (buffer[0] << 8) | buffer[1];
 		uint16_t count = (buffer[2] << 8) | buffer[3];
 		//printf("{offset = %d, count = %d}\n",offset,count);
+		markDirty(offset,count);
 		memcpy(m_dynamic + offset,buffer+4,count);
 		buffer += 4 + count;
-	} while (buffer[0]!=0xFF || buffer[1]!=0xFF);
+	}
+#if ENABLE_OBJECT_SHADOW
+	loadObjects();
+#endif
 	return pc;
 }
 
+// the stack goes last since its size depends on the story analysis
 bool machine::saveGame(uint32_t &pc,int &dest) {
-	chunk c[4]; 
+#if ENABLE_OBJECT_SHADOW
+	if (m_objDirty)
+		flushObjects();
+#endif
+	chunk c[5]; 
 	c[0].data = m_dynamic; c[0].size = m_dynamicSize;
-	c[1].data = &m_sp; c[1].size = (kStackSize + 2) * 2;
-	c[2].data = &pc; c[2].size = 4;
-	c[3].data = &dest; c[3].size = 4;
-	return interface::writeSaveData(c,4);
+	c[1].data = &pc; c[1].size = 4;
+	c[2].data = &dest; c[2].size = 4;
+	c[3].data = &m_sp; c[3].size = 4;
+	c[4].data = m_stack; c[4].size = m_sp * 2;
+	return interface::writeSaveData(c,5);
 }
 
 bool machine::restoreGame(uint32_t &pc,int &dest) {
-	chunk c[4];
+	chunk c[5];
 	c[0].data = m_dynamic; c[0].size = m_dynamicSize;
-	c[1].data = &m_sp; c[1].size = (kStackSize + 2) * 2;
-	c[2].data = &pc; c[2].size = 4;
-	c[3].data = &dest; c[3].size = 4;
-	return interface::readSaveData(c,4); 
+	c[1].data = &pc; c[1].size = 4;
+	c[2].data = &dest; c[2].size = 4;
+	c[3].data = &m_sp; c[3].size = 4;
+	c[4].data = m_stack; c[4].size = m_stackSize * 2;
+	bool result = interface::readSaveData(c,5);
+	markDirty(0,m_dynamicSize);
+#if ENABLE_OBJECT_SHADOW
+	// a failed read may still have overwritten part of dynamic memory
+	loadObjects();
+#endif
+	if (!result)
+		return false;
+	if (m_sp > m_stackSize || m_lp > m_sp)
+		fault("restored stack doesn't fit in %d words",m_stackSize);
+	return true;
 }
 
-void machine::run(uint32_t pc) {
-	random_seed = 2;
-	for (;;) {
+machine::status ZM_HOT_FUNC(machine::step)(uint32_t budget) {
+	if (m_status != status::running)
+		return m_status;
+	jmp_buf faultJmp;
+	if (setjmp(faultJmp)) {
+		m_faultJmp = nullptr;
+		return m_status = status::fault;
+	}
+	m_faultJmp = &faultJmp;
+	if (m_resume != status::running)
+		resume();
+	uint32_t pc = m_pc;
+	while (budget-- && m_status == status::running) {
 		m_faultpc = pc;
 		// if (pc == 0x8c6) __builtin_debugtrap();
 		uint16_t opcode = read_mem8(pc++);
@@ -727,6 +1145,15 @@ void machine::run(uint32_t pc) {
 #if ENABLE_DEBUG
 		if (m_debug)
 			printf("\n");
+#endif
+#if ENABLE_TRACE
+		traceRecord &trace = m_trace[m_traceNext++ & (kTraceSize-1)];
+		trace.pc = m_faultpc;
+		trace.opcode = opcode | (opCount << 12);
+		trace.operands[0] = opCount? operands[0].getU() : 0;
+		trace.operands[1] = opCount>1? operands[1].getU() : 0;
+		trace.result = 0;
+		uint16_t traceLp = m_lp;
 #endif
 		auto branch = [&](bool test) {
 			if (branch_offset == -32768)
@@ -801,7 +1228,15 @@ void machine::run(uint32_t pc) {
 				case _1op::print_obj: objPrint(operands[0].getU()); break;
 				case _1op::ret: pc = r_return(operands[0].getS()); break;
 				case _1op::jump: pc += operands[0].getS() - 2; break;
-				case _1op::print_paddr: print_zscii(m_staticStringOffset + (operands[0].getU() << m_storyShift)); break;
+				case _1op::print_paddr: {
+					uint32_t addr = m_staticStringOffset + (operands[0].getU() << m_storyShift);
+#if ENABLE_PROFILE
+					if (m_profile)
+						++(*m_profile)[addr];
+#endif
+					print_zscii(addr);
+					break;
+				}
 				case _1op::load: ref(dest,true) = var(operands[0].getS()); break;
 				case _1op::not_: if (m_header->version < 5) ref(dest,true).set(~operands[0].getU());
 					  else pc = call(pc,-1,operands,opCount); break;
@@ -818,13 +1253,16 @@ void machine::run(uint32_t pc) {
 							else ref(dest,true) = byte2word(saveGame(pc,dest)); break;
 				case _0op::restore: if (m_header->version<4) restoreGame(pc,dest); else if (restoreGame(pc,dest)) ref(dest,true) = byte2word(2); updateExtents(); break;
 				case _0op::restart: m_sp =  m_lp = 0; 
-							memcpy(m_dynamic, m_readOnly, m_dynamicSize); 
+							resetDynamic();
+#if ENABLE_OBJECT_SHADOW
+							loadObjects();
+#endif
 							updateExtents();
 							pc = m_header->initialPCAddr.getU();
 							 break;
 				case _0op::ret_popped: if (!m_sp) fault("stack underflow in ret_popped"); pc = r_return(m_stack[--m_sp].getU()); break;
 				case _0op::pop: if (!m_sp) fault("stack underflow in pop"); --m_sp; break;
-				case _0op::quit: exit(0); break;
+				case _0op::quit: m_status = status::quit; break;
 				case _0op::new_line: print_char(10); break;
 				case _0op::show_status: showStatus(); break;
 				case _0op::verify: branch(true); break; // fake verify?
@@ -848,10 +1286,12 @@ void machine::run(uint32_t pc) {
 				case _var::put_prop: objSetProperty(operands[0].getU(),operands[1].getU(),operands[2]); break;
 				case _var::sread: if (opCount != 2) fault("only two operand read opcode supported");
 						   showStatus();
-						   if (m_header->version>=5)
-						   	ref(dest,true).setByte(read_input(operands[0].getU(),operands[1].getU()));
-							else read_input(operands[0].getU(),operands[1].getU());
-							break;
+						   flushMainWindow();
+						   m_inputText = operands[0].getU();
+						   m_inputParse = operands[1].getU();
+						   m_inputDest = dest;
+						   m_status = status::needs_line;
+						   break;
 				case _var::print_char: print_char(operands[0].lo); break;
 				case _var::print_num: print_num(operands[0].getS()); break;
 				case _var::random: if (operands[0].getS() == 0)
@@ -862,16 +1302,16 @@ void machine::run(uint32_t pc) {
 							break;
 				case _var::push: push(operands[0]); break;
 				case _var::pull: var(operands[0].getS()) = pop(); break;
-				case _var::split_window: m_windowSplit = operands[0].getU(); break;
-				case _var::set_window: setWindow(operands[0].getU()); break;
+				case _var::split_window: m_windowSplit = operands[0].getU(); interface::splitWindow(m_windowSplit); m_statusLine.valid = false; break;
+				case _var::set_window: if (operands[0].notZero()) m_statusLine.valid = false; setWindow(operands[0].getU()); break;
 				case _var::call_vs2: pc = call(pc,dest,operands,opCount); break;
-				case _var::erase_window: interface::eraseWindow(operands[0].getS()); break; // erase_window
+				case _var::erase_window: interface::eraseWindow(operands[0].getS()); m_statusLine.valid = false; break; // erase_window
 				case _var::set_cursor: setCursor(operands[1].getU(),operands[0].getU()); break; // set_cursor line col
 				case _var::set_text_style: interface::setTextStyle(operands[0].lo); break; // set_text_style
 				case _var::buffer_mode: if (operands[0].notZero()) m_outputEnables |= 1; else m_outputEnables &= ~1; break; // buffer_mode
 				case _var::output_stream: setOutput(operands[0].getS(),opCount>1?operands[1].getU():0); break; // output_stream
 				case _var::sound_effect: break; // sound_effect
-				case _var::read_char: ref(dest,true).lo = interface::readchar(); break; // read_char
+				case _var::read_char: m_inputDest = dest; m_status = status::needs_char; break; // read_char
 				case _var::scan_table: branch(scanTable(dest,operands[0],operands[1].getU(),operands[2].getU(),
 							m_header->version>=5&&opCount==4?operands[3].lo:0x82));
 							break;
@@ -879,8 +1319,7 @@ void machine::run(uint32_t pc) {
 				case _var::call_vn: pc = call(pc,-1,operands,opCount); break;
 				case _var::call_vn2: pc = call(pc,-1,operands,opCount); break;
 				case _var::tokenise: 
-						if (opCount != 2) fault("only two-operand form of tokenise is supported");
-						tokenise(operands[0].getU(),operands[1].getU());
+						tokenise(operands[0].getU(),operands[1].getU(),2,opCount>2?operands[2].getU():0,opCount>3&&operands[3].notZero());
 						break;
 				case _var::print_table: printTable(operands[0].getU(),operands[1].getU(),opCount>2?operands[2].getU():1,
 						opCount>3?operands[3].getU():0);
@@ -898,12 +1337,20 @@ void machine::run(uint32_t pc) {
 						operands[0].getU() >> (256 - operands[1].lo)); break;
 				case _ext::art_shift: ref(dest,true).set(operands[1].lo <= 15? operands[0].getS() << operands[1].lo :
 						operands[0].getS() >> (256 - operands[1].lo)); break;
-				case _ext::save_undo:
-					if (m_undoTop + encodeDelta(0,nullptr) > sizeof(m_undoBuffer))
-						m_undoTop = 0;
-					m_undoTop += encodeDelta(pc | (dest<<20),m_undoBuffer + m_undoTop);
-					ref(dest,true) = byte2word(1); // save_undo
+				case _ext::save_undo: {
+					uint16_t size = encodeDelta(0,nullptr);
+					if (!m_undoSize)
+						ref(dest,true).set(-1); // undo not available for this story
+					else if (size > m_undoSize)
+						ref(dest,true) = byte2word(0);
+					else {
+						if (m_undoTop + size > m_undoSize)
+							m_undoTop = 0;
+						m_undoTop += encodeDelta(pc | (dest<<20),m_undoBuffer + m_undoTop);
+						ref(dest,true) = byte2word(1); // save_undo
+					}
 					break;
+				}
 				case _ext::restore_undo:
 					if (m_undoTop) {
 						m_undoTop -= (m_undoBuffer[m_undoTop-2] << 8) | m_undoBuffer[m_undoTop-1];
@@ -917,6 +1364,26 @@ void machine::run(uint32_t pc) {
 				default: fault("unimplemented EXT opcode %d (0x%x)",opcode,opcode); break;
 			}
 		}
+#if ENABLE_TRACE
+		// calls and returns change frames, so the store hasn't happened yet (or lands in another frame)
+		if (dest >= 0 && m_lp == traceLp && m_status == status::running)
+			trace.result = var(dest).getU();
+#endif
+	}
+	m_pc = pc;
+	m_faultJmp = nullptr;
+	return m_status;
+}
+
+machine::status machine::run() {
+	char buffer[256];
+	for (;;) {
+		switch (status s = step(10000)) {
+			case status::running: break;
+			case status::needs_line: interface::readline(buffer,sizeof(buffer)); provideLine(buffer); break;
+			case status::needs_char: provideChar(interface::readchar()); break;
+			case status::quit: case status::fault: return s;
+		}
 	}
 }
 
@@ -1,4 +1,47 @@
 #include "header.h"
+#include "analysis.h"
+#include "packed.h"
+
+#include <setjmp.h>
+
+#ifndef ENABLE_TRACE
+#define ENABLE_TRACE 1
+#endif
+
+#ifndef ENABLE_OBJECT_SHADOW
+#define ENABLE_OBJECT_SHADOW 1
+#endif
+
+#ifndef ENABLE_PACKED_STORY
+#define ENABLE_PACKED_STORY 1
+#endif
+
+#ifndef ENABLE_DIRTY_PAGES
+#define ENABLE_DIRTY_PAGES 1
+#endif
+
+// counts routine calls and strings printed by address, for laying out the next build (tinyz -P)
+#ifndef ENABLE_PROFILE
+#define ENABLE_PROFILE ENABLE_DEBUG
+#endif
+
+#if ENABLE_PROFILE
+#include <stdio.h>
+#include <unordered_map>
+#endif
+
+#ifndef ZMACHINE_IN_SRAM
+#define ZMACHINE_IN_SRAM 0
+#endif
+
+// Marks the dispatch loop and the helpers that showed up hottest when profiling a transcript.
+// With ZMACHINE_IN_SRAM they go in the sections __not_in_flash_func uses, which the Pico SDK
+// copies to SRAM at boot, so they never wait on the XIP cache. Everything else stays in flash.
+#if ZMACHINE_IN_SRAM
+#define ZM_HOT_FUNC(name) __attribute__((section(".time_critical.zmachine." #name))) name
+#else
+#define ZM_HOT_FUNC(name) name
+#endif
 
 /*
 	Example of a function that takes three parameters and has five locals total
@@ -29,6 +72,8 @@ struct chunk { void *data; uint32_t size; };
 class interface {
 public:
 	static char *readStory(const char*,long *sizePtr = nullptr);
+	// size bytes from offset in the story file, for packed stories whose pages readStory left in storage
+	static bool readStoryPart(void *dest,uint32_t offset,uint32_t size);
 	static void init(int,char**);
 	static void putchar(int ch);
 	static int readchar();
@@ -39,17 +84,42 @@ public:
 	static void setTextColor(uint8_t fore,uint8_t back);
 	static void setCursor(uint8_t,uint8_t);
 	static void setWindow(uint8_t);
+	static void splitWindow(uint8_t lines);
 	static void eraseWindow(uint8_t);
 	static void updateExtents(uint8_t&,uint8_t&);
+	// sidecar storage for derived data about the current story; either may fail harmlessly
+	static bool readCache(void *data,uint32_t size);
+	static bool writeCache(const void *data,uint32_t size);
 };
 
 class machine {
 public:
-	void init(const void*,bool debug);
-	void run(uint32_t pc);
+	// anything other than running means the host has to act before calling step again
+	enum class status: uint8_t { running, needs_line, needs_char, quit, fault };
+	static const uint16_t kStackSize = 2048; // 1<<13 (8192) is largest possible value
+	static const uint16_t kUndoSize = 4096;
+	// stackSize is used when the story's stack needs can't be determined statically; undoSize is
+	// only allocated for stories that can execute save_undo.
+	machine(uint16_t stackSize = kStackSize,uint16_t undoSize = kUndoSize);
+	~machine();
+	// size is how much of the story is at data; a packed story only needs its header and page
+	// offsets there, in which case pages are fetched with interface::readStoryPart as they're used
+	void init(const void *data,uint32_t size,bool debug);
+	// execute at most budget instructions, returning early if input is needed or the story stops
+	status step(uint32_t budget);
+	// supply the input requested by a needs_line or needs_char status; the next step completes the read
+	void provideLine(const char *line);
+	void provideChar(uint8_t ch);
+	// blocking loop that feeds step from interface::readline and interface::readchar
+	status run();
 	void showStatus();
 	void updateExtents();
 	void printObjTree();
+#if ENABLE_PROFILE
+	void startProfile();
+	// one line per address: byte address in hex, then how many times it was called or printed
+	void writeProfile(FILE *f) const;
+#endif
 private:
 	// first attribute (zero) is MSB of lowest byte.
 	struct object_small {	
@@ -96,89 +166,114 @@ private:
 	void print_num(int16_t v);
 	uint8_t m_abbrev, m_shift;
 	uint16_t m_extended;
+#if ENABLE_OBJECT_SHADOW
+	// native copies of the object table entries, indexed by object number. these are authoritative
+	// while running; m_dynamic is only brought up to date by flushObjects when something needs it.
+	uint16_t objParent(uint16_t o) const { return m_objParent[o]; }
+	uint16_t objSibling(uint16_t o) const { return m_objSibling[o]; }
+	uint16_t objChild(uint16_t o) const { return m_objChild[o]; }
+	uint16_t objPropAddr(uint16_t o) const { return m_objProps[o]; }
+	bool objAttr(uint16_t o,uint16_t a) const { return (m_objAttr[o] >> (63 - a)) & 1; }
+	void setObjParent(uint16_t o,uint16_t v) { m_objParent[o] = v; m_objDirty = true; }
+	void setObjSibling(uint16_t o,uint16_t v) { m_objSibling[o] = v; m_objDirty = true; }
+	void setObjChild(uint16_t o,uint16_t v) { m_objChild[o] = v; m_objDirty = true; }
+	void setObjAttr(uint16_t o,uint16_t a,bool set) {
+		if (set)
+			m_objAttr[o] |= 1ULL << (63 - a);
+		else
+			m_objAttr[o] &= ~(1ULL << (63 - a));
+		m_objDirty = true;
+	}
+	void loadObjects();
+	void loadObject(uint16_t o);
+	void flushObjects() const;
+#else
+	uint16_t objParent(uint16_t o) const {
+		return m_header->version<4? m_objectSmall->objTable[o-1].parent : m_objectLarge->objTable[o-1].parent.getU();
+	}
+	uint16_t objSibling(uint16_t o) const {
+		return m_header->version<4? m_objectSmall->objTable[o-1].sibling : m_objectLarge->objTable[o-1].sibling.getU();
+	}
+	uint16_t objChild(uint16_t o) const {
+		return m_header->version<4? m_objectSmall->objTable[o-1].child : m_objectLarge->objTable[o-1].child.getU();
+	}
+	uint16_t objPropAddr(uint16_t o) const {
+		return m_header->version<4? m_objectSmall->objTable[o-1].propAddr.getU() : m_objectLarge->objTable[o-1].propAddr.getU();
+	}
+	bool objAttr(uint16_t o,uint16_t a) const {
+		return m_header->version<4? m_objectSmall->objTable[o-1].testAttribute(a) : m_objectLarge->objTable[o-1].testAttribute(a);
+	}
+	void setObjParent(uint16_t o,uint16_t v) {
+		markDirty(m_objEntries + (o-1)*m_objEntrySize,m_objEntrySize);
+		if (m_header->version<4) m_objectSmall->objTable[o-1].parent = v; else m_objectLarge->objTable[o-1].parent.set(v);
+	}
+	void setObjSibling(uint16_t o,uint16_t v) {
+		markDirty(m_objEntries + (o-1)*m_objEntrySize,m_objEntrySize);
+		if (m_header->version<4) m_objectSmall->objTable[o-1].sibling = v; else m_objectLarge->objTable[o-1].sibling.set(v);
+	}
+	void setObjChild(uint16_t o,uint16_t v) {
+		markDirty(m_objEntries + (o-1)*m_objEntrySize,m_objEntrySize);
+		if (m_header->version<4) m_objectSmall->objTable[o-1].child = v; else m_objectLarge->objTable[o-1].child.set(v);
+	}
+	void setObjAttr(uint16_t o,uint16_t a,bool set) {
+		markDirty(m_objEntries + (o-1)*m_objEntrySize,m_objEntrySize);
+		if (m_header->version<4)
+			set? m_objectSmall->objTable[o-1].setAttribute(a) : m_objectSmall->objTable[o-1].clearAttribute(a);
+		else
+			set? m_objectLarge->objTable[o-1].setAttribute(a) : m_objectLarge->objTable[o-1].clearAttribute(a);
+	}
+#endif
 	bool objIsChildOf(uint16_t o1,uint16_t o2) const {
 		if (!o1 || o1 > m_objCount)
 			fault("jin first object %d out of range",o1);
 		if (o2 > m_objCount)
 			fault("jin second object %d out of range",o2);
-		return o2 == (m_header->version<4
-				? m_objectSmall->objTable[o1-1].parent 
-				: m_objectLarge->objTable[o1-1].parent.getU());
-
+		return o2 == objParent(o1);
 	}
 	bool objTestAttribute(uint16_t o,uint16_t attr) const {
 		if (!o || o > m_objCount)
 			fault("test_attr object %d out of range",o);
 		if (attr >= (m_header->version<4? 32 : 48))
 			fault("test_attr attribute %d out of range",attr);
-		return m_header->version < 4
-			? m_objectSmall->objTable[o-1].testAttribute(attr)
-			: m_objectLarge->objTable[o-1].testAttribute(attr);
+		return objAttr(o,attr);
 	}
 	void objSetAttribute(uint16_t o,uint16_t attr) {
 		if (!o || o > m_objCount)
 			fault("set_attr object %d out of range",o);
 		if (attr >= (m_header->version<4? 32 : 48))
 			fault("set_attr attribute %d out of range",attr);
-		return m_header->version < 4
-			? m_objectSmall->objTable[o-1].setAttribute(attr)
-			: m_objectLarge->objTable[o-1].setAttribute(attr);
+		setObjAttr(o,attr,true);
 	}
 	void objClearAttribute(uint16_t o,uint16_t attr) {
 		if (!o || o > m_objCount)
 			fault("clear_attr object %d out of range",o);
 		if (attr >= (m_header->version<4? 32 : 48))
 			fault("clear_attr attribute %d out of range",attr);
-		return m_header->version < 4
-			? m_objectSmall->objTable[o-1].clearAttribute(attr)
-			: m_objectLarge->objTable[o-1].clearAttribute(attr);
+		setObjAttr(o,attr,false);
 	}
 	void objUnparent(uint16_t o) {
 		if (!o || o>m_objCount)
 			fault("remove_obj object %d out of range",o);
-		if (m_header->version < 4) {
-			uint8_t p = m_objectSmall->objTable[o-1].parent;
-			uint8_t s = m_objectSmall->objTable[o-1].sibling;
-			if (p && m_objectSmall->objTable[p-1].child == o)
-				m_objectSmall->objTable[p-1].child = s;
-			// scan entire object table to find dangling sibling reference (parent may be zero)
-			else for (uint16_t i=1; i<=m_objCount; i++)
-				if (m_objectSmall->objTable[i-1].sibling == o) {
-					m_objectSmall->objTable[i-1].sibling = s;
-					break;
-				}
-			m_objectSmall->objTable[o-1].parent = 0;
-			m_objectSmall->objTable[o-1].sibling = 0;
-		}
-		else {
-			word p = m_objectLarge->objTable[o-1].parent;
-			word s = m_objectLarge->objTable[o-1].sibling;
-			if (p.notZero() && m_objectLarge->objTable[p.getU()-1].child.getU() == o)
-				m_objectLarge->objTable[p.getU()-1].child = s;
-			// scan entire object table to find dangling sibling reference (parent may be zero)
-			else for (uint16_t i=1; i<=m_objCount; i++)
-				if (m_objectLarge->objTable[i-1].sibling.getU() == o) {
-					m_objectLarge->objTable[i-1].sibling = s;
-					break;
-				}
-			m_objectLarge->objTable[o-1].parent.setByte(0);
-			m_objectLarge->objTable[o-1].sibling.setByte(0);
-		}
+		uint16_t p = objParent(o);
+		uint16_t s = objSibling(o);
+		if (p && objChild(p) == o)
+			setObjChild(p,s);
+		// scan entire object table to find dangling sibling reference (parent may be zero)
+		else for (uint16_t i=1; i<=m_objCount; i++)
+			if (objSibling(i) == o) {
+				setObjSibling(i,s);
+				break;
+			}
+		setObjParent(o,0);
+		setObjSibling(o,0);
 	}
 	void objMoveTo(uint16_t o1,uint16_t o2) {
 		objUnparent(o1);
 		if (!o2 || o2>m_objCount)
 			fault("move_obj destination %d out of range",o2);
-		if (m_header->version < 4) {
-			m_objectSmall->objTable[o1-1].parent = o2;
-			m_objectSmall->objTable[o1-1].sibling = m_objectSmall->objTable[o2-1].child;
-			m_objectSmall->objTable[o2-1].child = o1;
-		}
-		else {
-			m_objectLarge->objTable[o1-1].parent.set(o2);
-			m_objectLarge->objTable[o1-1].sibling = m_objectLarge->objTable[o2-1].child;
-			m_objectLarge->objTable[o2-1].child.set(o1);
-		}
+		setObjParent(o1,o2);
+		setObjSibling(o1,objChild(o2));
+		setObjChild(o2,o1);
 	}
 	static uint8_t zeroIs64(uint8_t f) { return f? f : 64; }
 	word objGetProperty(uint16_t o,uint16_t prop) const {
@@ -189,7 +284,7 @@ private:
 		// this is the only one that returns a default property if it's not present
 		// properties are stored in descending order.
 		if (m_header->version < 4) {
-			uint16_t pa = m_objectSmall->objTable[o-1].propAddr.getU();
+			uint16_t pa = objPropAddr(o);
 			// skip object description
 			pa += 1 + (read_mem8(pa)<<1);
 			for(;;) {
@@ -208,7 +303,7 @@ private:
 			} 
 		}
 		else {
-			uint16_t pa = m_objectLarge->objTable[o-1].propAddr.getU();
+			uint16_t pa = objPropAddr(o);
 			// skip object description
 			pa += 1 + (read_mem8(pa)<<1);
 			for(;;) {
@@ -236,7 +331,7 @@ private:
 			fault("get_prop_addr property index %d out of range",prop);
 		// properties are stored in descending order.
 		if (m_header->version < 4) {
-			uint16_t pa = m_objectSmall->objTable[o-1].propAddr.getU();
+			uint16_t pa = objPropAddr(o);
 			// skip object description
 			pa += 1 + (read_mem8(pa)<<1);
 			for(;;) {
@@ -249,7 +344,7 @@ private:
 			}
 		}
 		else {
-			uint16_t pa = m_objectLarge->objTable[o-1].propAddr.getU();
+			uint16_t pa = objPropAddr(o);
 			// skip object description
 			pa += 1 + (read_mem8(pa)<<1);
 			for(;;) {
@@ -291,7 +386,7 @@ private:
 		if (!o||o>m_objCount)
 			fault("get_next_prop invalid object number %d",o);
 		if (m_header->version < 4) {
-			uint16_t pa = m_objectSmall->objTable[o-1].propAddr.getU();
+			uint16_t pa = objPropAddr(o);
 			// skip object description
 			pa += 1 + (read_mem8(pa)<<1);
 			for(;;) {
@@ -304,7 +399,7 @@ private:
 			}
 		}
 		else {
-			uint16_t pa = m_objectLarge->objTable[o-1].propAddr.getU();
+			uint16_t pa = objPropAddr(o);
 			// skip object description
 			pa += 1 + (read_mem8(pa)<<1);
 			for(;;) {
@@ -332,9 +427,7 @@ private:
 	word objGetSibling(uint16_t o) const {
 		if (!o || o>m_objCount)
 			fault("get_sibling object %d out of range",o);
-		return m_header->version < 4
-			? byte2word(m_objectSmall->objTable[o-1].sibling)
-			: m_objectLarge->objTable[o-1].sibling;				
+		return word2word(objSibling(o));
 	}
 	word objGetChild(uint16_t o) const {
 		// theatre.z5 might have a bug in it?
@@ -342,67 +435,140 @@ private:
 			return byte2word(0);
 		if (/*!o ||*/ o>m_objCount)
 			fault("get_child object %d out of range",o);
-		return m_header->version < 4
-			? byte2word(m_objectSmall->objTable[o-1].child)
-			: m_objectLarge->objTable[o-1].child;		
+		return word2word(objChild(o));
 	}
 	word objGetParent(uint16_t o) const {
 		if (!o || o>m_objCount)
 			fault("get_parent object %d out of range",o);
-		return m_header->version < 4
-			? byte2word(m_objectSmall->objTable[o-1].parent)
-			: m_objectLarge->objTable[o-1].parent;
+		return word2word(objParent(o));
 	}
 
 	void objPrint(uint16_t o) {
 		if (!o || o>m_objCount)
 			fault("print_obj object %d out of range",o);	
-		uint16_t pa = m_header->version<4? m_objectSmall->objTable[o-1].propAddr.getU() : m_objectLarge->objTable[o-1].propAddr.getU();
+		uint16_t pa = objPropAddr(o);
 		if (read_mem8(pa))
 			print_zscii(pa+1);	
 	}
 
-	uint8_t read_mem8(uint32_t addr) const {
+	// the story as it was loaded, whatever has happened to dynamic memory since
+#if ENABLE_PACKED_STORY
+	uint8_t ZM_HOT_FUNC(readOnly8)(uint32_t addr) const {
+		uint32_t offset = addr - m_windowStart;
+		if (offset < m_windowSize)
+			return m_window[offset];
+		pageIn(addr);
+		return m_window[addr - m_windowStart];
+	}
+	word ZM_HOT_FUNC(readOnly16)(uint32_t addr) const {
+		uint32_t offset = addr - m_windowStart;
+		if (offset + 1 < m_windowSize)
+			return *(word*)(m_window + offset);
+		word w;
+		w.setHL(readOnly8(addr),readOnly8(addr+1));
+		return w;
+	}
+#else
+	uint8_t readOnly8(uint32_t addr) const {
+		return m_readOnly[addr];
+	}
+	word readOnly16(uint32_t addr) const {
+		return *(word*)(m_readOnly+addr);
+	}
+#endif
+	void copyStory(void *dest,uint32_t addr,uint32_t size) const;
+
+	// dynamic memory is tracked in small pages. a clean page still matches the story, so restart
+	// and undo only have to copy back the dirty ones and encodeDelta only has to compare those.
+	static const uint8_t kDirtyPageShift = 6;
+#if ENABLE_DIRTY_PAGES
+	void markDirty(uint32_t addr,uint32_t size = 1) const {
+		for (uint32_t p = addr >> kDirtyPageShift; p <= (addr + size - 1) >> kDirtyPageShift; p++)
+			m_dirtyPages[p >> 3] |= 1 << (p & 7);
+	}
+	bool isDirty(uint32_t addr) const {
+		return (m_dirtyPages[addr >> (kDirtyPageShift + 3)] >> ((addr >> kDirtyPageShift) & 7)) & 1;
+	}
+#else
+	void markDirty(uint32_t,uint32_t = 1) const { }
+	bool isDirty(uint32_t) const { return true; }
+#endif
+	void resetDynamic();
+
+	uint8_t ZM_HOT_FUNC(read_mem8)(uint32_t addr) const {
 		if (addr >= m_readOnlySize)
 			memfault("out of range address %x (highest is %x)",addr,m_readOnlySize);
-		return addr < m_dynamicSize? m_dynamic[addr] : m_readOnly[addr];
+#if ENABLE_OBJECT_SHADOW
+		if (m_objDirty && addr - m_objEntries < m_objEntriesSize)
+			flushObjects();
+#endif
+		return addr < m_dynamicSize? m_dynamic[addr] : readOnly8(addr);
 	}
-	word read_mem16(uint32_t addr) const {
+	word ZM_HOT_FUNC(read_mem16)(uint32_t addr) const {
 		if (addr >= m_readOnlySize)
 			memfault("out of range address %x (highest is %x)",addr,m_readOnlySize);
-		return addr+1 < m_dynamicSize? *(word*)(m_dynamic+addr) : *(word*)(m_readOnly+addr);
+#if ENABLE_OBJECT_SHADOW
+		if (m_objDirty && addr + 1 - m_objEntries <= m_objEntriesSize)
+			flushObjects();
+#endif
+		return addr+1 < m_dynamicSize? *(word*)(m_dynamic+addr) : readOnly16(addr);
 	}
-	void write_mem8(uint32_t addr,uint8_t v) {
+	void ZM_HOT_FUNC(write_mem8)(uint32_t addr,uint8_t v) {
 		if (addr>=m_dynamicSize)
 			memfault("out of range write to %06x",addr);
 		if (addr < 0x38 && addr != 0x10 && addr != 0x11)
 			memfault("illegal write to header addr %02x",addr);
+#if ENABLE_OBJECT_SHADOW
+		if (addr - m_objEntries < m_objEntriesSize) {
+			flushObjects();
+			m_dynamic[addr] = v;
+			loadObject((addr - m_objEntries) / m_objEntrySize + 1);
+			return;
+		}
+#endif
+		markDirty(addr);
 		m_dynamic[addr] = v;
 	}
-	void write_mem16(uint32_t addr,word v) {
+	void ZM_HOT_FUNC(write_mem16)(uint32_t addr,word v) {
 		if (addr+1>=m_dynamicSize)
 			memfault("out of range write to %06x",addr);
 		if (addr < 0x38 && addr != 0x10)
 			memfault("illegal write to header addr %02x",addr);
+#if ENABLE_OBJECT_SHADOW
+		if (addr + 1 - m_objEntries <= m_objEntriesSize) {
+			write_mem8(addr,v.hi);
+			write_mem8(addr+1,v.lo);
+			return;
+		}
+#endif
+		markDirty(addr,2);
 		m_dynamic[addr] = v.hi;
 		m_dynamic[addr+1] = v.lo;
 	}
 	
-	word &ref(int v,bool write) {
+	word &ZM_HOT_FUNC(ref)(int v,bool write) {
 		if (v<0||v>255)
 			fault("invalid reference %d",v);
 		if (!v) {
-			if (write)
+			// the stack may be sized exactly from the analysis, so these are all that stand between a
+			// bad story and the heap
+			if (write) {
+				if (m_sp >= m_stackSize)
+					fault("stack overflow");
 				return m_stack[m_sp++];
-			else
+			}
+			else {
+				if (!m_sp)
+					fault("stack underflow");
 				return m_stack[--m_sp];
+			}
 		}
 		else if (v < 16)
 			return m_stack[m_lp + v + 2];
 		else
-			return *(word*)(m_dynamic + m_globalsOffset + (v-16)*2);
+			return m_globals[v-16];
 	}
-	word &var(int v) {
+	word &ZM_HOT_FUNC(var)(int v) {
 		if (v<0||v>255)
 			fault("invalid variable %d",v);
 		else if (!v) {
@@ -413,7 +579,7 @@ private:
 		else if (v < 16)
 			return m_stack[m_lp + v + 2];
 		else
-			return *(word*)(m_dynamic + m_globalsOffset + (v-16)*2);
+			return m_globals[v-16];
 	}
 	bool scanTable(uint8_t dest,word x,uint16_t table,uint16_t len,uint8_t form) {
 		if (form & 0x80) {
@@ -436,7 +602,7 @@ private:
 	void printTable(uint16_t zsciiAddr,uint16_t width,uint16_t height,uint16_t skip);
 	void copyTable(uint16_t first,uint16_t second,int16_t count);
 	void push(word w) {
-		if (m_sp == kStackSize)
+		if (m_sp == m_stackSize)
 			fault("stack overflow in push");
 		m_stack[m_sp++] = w;
 	}
@@ -448,6 +614,22 @@ private:
 	// return value of both is new pc value.
 	uint32_t call(uint32_t pc,int dest,word operands[],uint8_t opCount);
 	uint32_t r_return(uint16_t v);
+#if ENABLE_TRACE
+	// the last few instructions executed, written unformatted and dumped by fault() for zdis -trace
+	struct traceRecord {
+		uint32_t pc;
+		uint16_t opcode;		// operand count in the top four bits
+		uint16_t operands[2];
+		uint16_t result;		// value stored, if any
+	};
+	static const uint16_t kTraceSize = 64;	// must be a power of two
+	traceRecord m_trace[kTraceSize];
+	uint16_t m_traceNext;
+	void dumpTrace() const;
+#endif
+#if ENABLE_PROFILE
+	std::unordered_map<uint32_t,uint32_t> *m_profile;
+#endif
 	[[noreturn]] void fault(const char*,...) const;
 	[[noreturn]] void memfault(const char*,...) const;
 	void setWindow(uint8_t w);
@@ -456,27 +638,70 @@ private:
 	void flushMainWindow();
 	bool saveGame(uint32_t&,int&);
 	bool restoreGame(uint32_t&,int&);
-	union {
-		const uint8_t *m_readOnly; 	// can be in flash etc or memory mapped file
-		const storyHeader *m_header;	
-	};
+	const uint8_t *m_readOnly; 	// can be in flash etc or memory mapped file; null if the story is packed
+	const storyHeader *m_header;	// the story, or m_dynamic if the story is packed
+#if ENABLE_PACKED_STORY
+	// reads outside dynamic memory go through a window onto the story: all of it when it's stored
+	// raw, otherwise the most recently used page in the cache
+	static const uint8_t kPageCacheSize = 4;
+	void pageIn(uint32_t addr) const;
+	const packedStory *m_packed;
+	uint8_t *m_pageCache;
+	uint8_t *m_pageBuffer;		// a page as stored, when the pages are left in storage
+	mutable const uint8_t *m_window;
+	mutable uint32_t m_windowStart, m_windowSize;
+	mutable uint16_t m_cachedPage[kPageCacheSize];
+	mutable uint8_t m_cacheAge[kPageCacheSize];
+#endif
 	union {
 		object_header_small *m_objectSmall;
 		object_header_large *m_objectLarge;
 	};
 	void encode_text(word dest[],const char *src,uint8_t wordLen);
 	uint8_t read_input(uint16_t textAddr,uint16_t parseAddr);
-	uint8_t tokenise(uint16_t textAddr,uint16_t parseAddr,uint8_t offset = 2);
+	void resume();
+	uint8_t tokenise(uint16_t textAddr,uint16_t parseAddr,uint8_t offset = 2,uint16_t dictAddr = 0,bool keepUnknown = false);
+	// layout and separator set of the dictionary tokenise last used, so switching between the main
+	// one and a story's own (V5 tokenise) is the only time the header is read again
+	struct dictionary {
+		uint16_t addr;			// zero if nothing is cached yet
+		uint16_t entries;
+		uint8_t entryLength;
+		int16_t count;			// negative if the entries aren't sorted
+		uint32_t separators[8];	// bit per ZSCII character
+		bool isSeparator(uint8_t ch) const { return (separators[ch >> 5] >> (ch & 31)) & 1; }
+	};
+	void useDictionary(uint16_t addr);
+	dictionary m_dict;
 	uint16_t encodeDelta(uint32_t pc,uint8_t *buffer);
 	uint32_t applyDelta(const uint8_t *buffer);
 	uint8_t *m_dynamic;		// everything up to 'static' cutoff
-	static const uint16_t kStackSize = 2048; // 1<<13 (8192) is largest possible value
+	word *m_globals;		// the story's globals table within m_dynamic
+#if ENABLE_DIRTY_PAGES
+	// one bit per page, with a byte of slack for a globals table right at the top of 64K
+	mutable uint8_t m_dirtyPages[(0x10000 >> kDirtyPageShift) / 8 + 1];
+#endif
 	uint16_t m_sp, m_lp;
-	word m_stack[kStackSize];
-	uint8_t m_undoBuffer[4096];
-	uint16_t m_undoTop;
+	word *m_stack;
+	uint8_t *m_undoBuffer;
+	uint16_t m_stackSize, m_undoSize, m_undoTop;
+	uint16_t m_fallbackStackSize, m_maxUndoSize;
+	storyAnalysis m_analysis;
+	uint32_t m_objEntries, m_objEntriesSize;	// byte range of the object entries (after the default properties)
+	uint8_t m_objEntrySize;
+#if ENABLE_OBJECT_SHADOW
+	uint16_t *m_objParent, *m_objSibling, *m_objChild, *m_objProps;
+	uint64_t *m_objAttr;
+	mutable bool m_objDirty;
+#endif
 	char m_zscii[26*3];
 	char m_lineBuffer[256];
+	char m_input[256];
+	uint32_t m_pc;
+	status m_status, m_resume;
+	uint16_t m_inputText, m_inputParse;
+	int m_inputDest;
+	jmp_buf *m_faultJmp;
 	uint16_t m_dynamicSize, m_globalsOffset, m_abbreviations, m_objCount;
 	uint32_t m_readOnlySize;
 	uint32_t m_faultpc;
@@ -488,6 +713,13 @@ private:
 	uint8_t m_stored;
 	uint8_t m_windowSplit;
 	uint8_t m_outputEnables;
+	// what the status line was last drawn from; showStatus leaves the screen alone until one changes
+	struct statusLine {
+		uint16_t location, moves;
+		int16_t score;
+		uint8_t width, height;
+		bool valid;
+	} m_statusLine;
 	uint8_t m_cursorX, m_cursorY;
 	uint8_t m_saveX, m_saveY;
 	uint8_t m_currentWindow;
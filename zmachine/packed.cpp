@@ -0,0 +1,175 @@
+#include "packed.h"
+
+#include <stddef.h>
+#include <string.h>
+
+bool packedStory::is(const void *data) {
+	const packedStory *p = (const packedStory*) data;
+	return !memcmp(p->magic,"TZPK",4) && p->version == kVersion;
+}
+
+// LZ4 block decoding. Whatever file is in flash gets fed through this, so it stays inside both src
+// and dest however the block is damaged.
+static uint32_t decodeBlock(const uint8_t *src,uint32_t srcSize,uint8_t *dest,uint32_t destSize) {
+	const uint8_t *ip = src, *ipEnd = src + srcSize;
+	uint8_t *op = dest, *opEnd = dest + destSize;
+	while (ip < ipEnd) {
+		uint8_t token = *ip++;
+		uint32_t length = token >> 4;
+		if (length == 15) {
+			uint8_t b;
+			do {
+				if (ip >= ipEnd)
+					return op - dest;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+		if (length > (uint32_t)(opEnd - op) || length > (uint32_t)(ipEnd - ip))
+			break;
+		memcpy(op,ip,length);
+		op += length;
+		ip += length;
+		if (ip >= ipEnd)
+			break;	// the last sequence is only literals
+		if (ipEnd - ip < 2)
+			break;
+		uint16_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		length = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			uint8_t b;
+			do {
+				if (ip >= ipEnd)
+					return op - dest;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+		if (!offset || offset > op - dest || length > (uint32_t)(opEnd - op))
+			break;
+		// matches can overlap what they produce, so this has to go a byte at a time
+		const uint8_t *match = op - offset;
+		while (length--)
+			*op++ = *match++;
+	}
+	return op - dest;
+}
+
+uint32_t packedStory::pageBytes(uint16_t page) const {
+	uint32_t start = (uint32_t)page << pageShift;
+	return storySize - start < pageSize()? storySize - start : pageSize();
+}
+
+bool packedStory::valid() const {
+	if (pageShift < kMinPageShift || pageShift > kMaxPageShift || !storySize ||
+		pageCount != (storySize >> pageShift) + !!(storySize & (pageSize() - 1)) || pageOffsets[0] != headerSize())
+		return false;
+	// packing never lets a page grow, so one that's bigger than it unpacks to is damage
+	for (uint16_t i=0; i<pageCount; i++)
+		if (pageOffsets[i+1] <= pageOffsets[i] || storedBytes(i) > pageBytes(i))
+			return false;
+	return true;
+}
+
+uint32_t packedStory::unpackPage(uint16_t page,uint8_t *dest,const uint8_t *src) const {
+	uint32_t size = pageBytes(page);
+	uint32_t stored = storedBytes(page);
+	if (!src)
+		src = (const uint8_t*)this + pageOffsets[page];
+	if (stored == size) {
+		memcpy(dest,src,size);
+		return size;
+	}
+	return decodeBlock(src,stored,dest,size);
+}
+
+static uint8_t *putLength(uint8_t *op,uint32_t length) {
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = length;
+	return op;
+}
+
+// greedy LZ4 block encoding; returns 0 if the result wouldn't be smaller than size
+static uint32_t encodeBlock(const uint8_t *src,uint32_t size,uint8_t *dest) {
+	const uint8_t kHashBits = 12;
+	uint16_t table[1 << kHashBits];
+	memset(table,0xFF,sizeof(table));
+	// the format wants the last five bytes as literals and no match starting in the last twelve
+	uint32_t matchLimit = size > 12? size - 12 : 0, literalTail = size > 5? size - 5 : 0;
+	uint32_t anchor = 0, i = 0;
+	uint8_t *op = dest;
+	// worst case for a sequence is its literals plus about one byte in 255 plus token and offset
+	auto fits = [&](uint32_t literals) { return (op - dest) + literals + literals / 255 + 8 < size; };
+	while (i < matchLimit) {
+		uint32_t seq;
+		memcpy(&seq,src + i,4);
+		uint32_t h = (seq * 2654435761U) >> (32 - kHashBits);
+		uint32_t ref = table[h];
+		table[h] = i;
+		if (ref == 0xFFFF || memcmp(src + ref,src + i,4)) {
+			++i;
+			continue;
+		}
+		uint32_t length = 4;
+		while (i + length < literalTail && src[ref + length] == src[i + length])
+			++length;
+		uint32_t literals = i - anchor;
+		if (!fits(literals))
+			return 0;
+		uint8_t *token = op++;
+		*token = (literals < 15? literals : 15) << 4;
+		if (literals >= 15)
+			op = putLength(op,literals - 15);
+		memcpy(op,src + anchor,literals);
+		op += literals;
+		*op++ = (i - ref);
+		*op++ = (i - ref) >> 8;
+		*token |= length - 4 < 15? length - 4 : 15;
+		if (length - 4 >= 15)
+			op = putLength(op,length - 4 - 15);
+		i += length;
+		anchor = i;
+	}
+	uint32_t literals = size - anchor;
+	if (!fits(literals))
+		return 0;
+	*op++ = (literals < 15? literals : 15) << 4;
+	if (literals >= 15)
+		op = putLength(op,literals - 15);
+	memcpy(op,src + anchor,literals);
+	op += literals;
+	return op - dest;
+}
+
+uint32_t packBound(uint32_t storySize,uint8_t pageShift) {
+	uint32_t pageCount = (storySize + (1U << pageShift) - 1) >> pageShift;
+	return offsetof(packedStory,pageOffsets) + (pageCount + 1) * 4 + storySize;
+}
+
+uint32_t packStory(const uint8_t *story,uint32_t storySize,uint8_t *dest,uint8_t pageShift) {
+	packedStory *p = (packedStory*) dest;
+	memset(p,0,offsetof(packedStory,pageOffsets));
+	memcpy(p->magic,"TZPK",4);
+	p->version = packedStory::kVersion;
+	p->pageShift = pageShift;
+	p->storySize = storySize;
+	p->checksum = storyChecksum(story,storySize);
+	p->pageCount = (storySize + p->pageSize() - 1) >> pageShift;
+	analyzeStory(story,storySize,p->analysis);
+	uint32_t offset = offsetof(packedStory,pageOffsets) + (p->pageCount + 1) * 4;
+	for (uint16_t i=0; i<p->pageCount; i++) {
+		uint32_t start = (uint32_t)i << pageShift;
+		uint32_t size = storySize - start < p->pageSize()? storySize - start : p->pageSize();
+		p->pageOffsets[i] = offset;
+		uint32_t packed = encodeBlock(story + start,size,dest + offset);
+		if (!packed) {
+			memcpy(dest + offset,story + start,size);
+			packed = size;
+		}
+		offset += packed;
+	}
+	p->pageOffsets[p->pageCount] = offset;
+	return offset;
+}
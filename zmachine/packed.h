@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "analysis.h"
+
+// A story stored as independently compressed pages, so the interpreter can keep it in flash and
+// decompress whichever part it needs into a small cache. Pages use the LZ4 block format; a page
+// that wouldn't get smaller is stored as is. Shared by tinyz (which writes it) and the interpreter.
+struct packedStory {
+	static const uint16_t kVersion = 1;
+	static const uint8_t kDefaultPageShift = 10;
+	static const uint8_t kMinPageShift = 8, kMaxPageShift = 14;
+	char magic[4];				// "TZPK"
+	uint16_t version;
+	uint8_t pageShift;			// pages are 1 << pageShift bytes
+	uint8_t reserved;
+	uint32_t storySize;
+	uint16_t checksum;			// storyChecksum of the unpacked story
+	uint16_t pageCount;
+	storyAnalysis analysis;		// done at pack time since the interpreter never sees the whole story at once
+	uint32_t pageOffsets[1];	// pageCount+1 entries, relative to the start of this struct
+
+	static bool is(const void *data);
+	uint32_t pageSize() const { return 1U << pageShift; }
+	// everything up to the first page, which is all a reader needs to fetch pages from storage
+	uint32_t headerSize() const { return offsetof(packedStory,pageOffsets) + (pageCount + 1) * 4; }
+	uint32_t packedSize() const { return pageOffsets[pageCount]; }
+	// bytes in a page once it's unpacked (only the last is short), and as it's stored
+	uint32_t pageBytes(uint16_t page) const;
+	uint32_t storedBytes(uint16_t page) const { return pageOffsets[page+1] - pageOffsets[page]; }
+	// whether the header and page offsets agree with each other; the pages themselves aren't read
+	bool valid() const;
+	// decompresses a page into dest, which must hold pageSize() bytes; returns the bytes produced.
+	// src is the page as stored, which is where it sits after the header unless it's given.
+	uint32_t unpackPage(uint16_t page,uint8_t *dest,const uint8_t *src = nullptr) const;
+};
+
+// upper bound on the packed size of a story
+uint32_t packBound(uint32_t storySize,uint8_t pageShift = packedStory::kDefaultPageShift);
+
+// writes the packed form of story to dest (which must hold packBound bytes) and returns its size
+uint32_t packStory(const uint8_t *story,uint32_t storySize,uint8_t *dest,uint8_t pageShift = packedStory::kDefaultPageShift);
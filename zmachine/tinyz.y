@@ -6,12 +6,21 @@
 	#define ENABLE_DEBUG 1
 	#include "opcodes.h"
 	#include "header.h"
+	#include "packed.h"
+	#include <algorithm>
+	#include <atomic>
 	#include <set>
 	#include <map>
+	#include <mutex>
+	#include <queue>
+	#include <string_view>
+	#include <thread>
+	#include <unordered_map>
 	#include <cassert>
 
 	int yylex();
 	void yyerror(const char*,...);
+	extern thread_local int yyline;
 	uint16_t encode_string(uint8_t *dest,size_t destSize,const char *src,size_t srcSize,bool forDict = false);
 	int encode_string(const char*);
 	const uint8_t* print_encoded_string(const uint8_t *src,void (*pr)(char ch));
@@ -40,6 +49,7 @@
 	const uint16_t UD_DYNAMIC = 1;
 	const uint16_t UD_STATIC = 2;
 	const uint16_t UD_HIGH = 3;
+	const uint16_t UD_WORD = 4;	// static, but referred to by word address (abbreviations)
 
 	// a relocatable blob can itself be relocated, and can contain
 	// zero or more references to other relocatable blobs.
@@ -141,6 +151,18 @@
 					the_relocations[i]->place(type==UD_HIGH?(1U << story_shift)-1:0U);
 			}
 		}
+		// as above, but hottest first (heat is by index); blobs that are equally hot keep their order
+		static void placeAll(uint16_t type,const std::vector<uint32_t> &heat) {
+			std::vector<uint16_t> order;
+			for (uint16_t i=0; i<the_relocations.size(); i++) {
+				if ((size_t)the_relocations[i] > 0xFFFF && the_relocations[i]->address == ~0U &&
+					the_relocations[i]->userData == type)
+					order.push_back(i);
+			}
+			std::stable_sort(order.begin(),order.end(),[&](uint16_t a,uint16_t b) { return heat[a] > heat[b]; });
+			for (auto i: order)
+				the_relocations[i]->place(type==UD_HIGH?(1U << story_shift)-1:0U);
+		}
 		static void writeAll(FILE *output) {
 			uint16_t i = firstPlaced;
 			while (i != 0xFFFF) {
@@ -184,7 +206,7 @@
 			int count = 0;
 			for (auto i = relocations; i; i=i->cdr, count++) {
 				auto &r = *the_relocations[i->car.first];
-				uint16_t a = r.address >> (r.userData == UD_HIGH? story_shift : 0);
+				uint16_t a = r.address >> (r.userData == UD_HIGH? story_shift : r.userData == UD_WORD? 1 : 0);
 				a += contents[i->car.second + 1];	// add lower byte of offset;
 				contents[i->car.second] = a >> 8;
 				contents[i->car.second + 1] = a;
@@ -212,15 +234,29 @@
 	int16_t entry_point_index = -1;
 	uint8_t action_bit = 0;
 
+	// abbreviations are picked after pass 1 from every string literal in the source, and
+	// encode_string uses them from then on (apart from dictionary words, which can't)
+	struct abbreviation {
+		std::string text;
+		relocatableBlob *blob;
+	};
+	std::vector<abbreviation> the_abbreviations;
+	std::vector<uint8_t> abbreviation_index[256];	// by first character
+	relocatableBlob *abbreviations_blob;
+	unsigned abbreviation_count = 96;
+
 	static const uint8_t opsizes[3] = { 2,1,1 };
 	const uint8_t LONG_JUMP = 0x8C;			// +/-32767
 	const uint8_t SHORT_JUMP = 0x9C;		// 0-255
 	const uint8_t CALL_VS = 0xE0;
 
-	relocatableBlob * currentRoutine;
+	// everything a routine body touches while it's emitted is per thread
+	thread_local relocatableBlob * currentRoutine;
 	uint8_t currentProperty, currentBits;
 	void emitByte(uint8_t b) {
 		// printf("%04x: %02x\n",currentRoutine->offset,b);
+		if (currentRoutine->offset == currentRoutine->size)
+			yyerror("routine too large");
 		currentRoutine->storeByte(b);
 	}
 	void emitOperand(operand o) {
@@ -248,79 +284,372 @@
 	void emit1op(_1op op,operand un);
 	void emit0op(_0op op) { emitByte(uint8_t(op) | 0xB0); }
 	const uint8_t TOS = 0, SCRATCH = 3;
+	// locals past the routine's own that hold intermediate results instead of the stack;
+	// next_temp is the last one in use and last_temp the highest any expression needed
+	thread_local uint8_t next_temp, last_temp;
 
 	typedef struct label_info {
 		uint16_t offset;
-		list_node<uint16_t> *references;
 	} *label;
 	label createLabel() {
 		label result = new label_info;
 		result->offset = 0xFFFF;
-		result->references = nullptr;
 		return result;
 	}
 	label rfalseLabel, rtrueLabel;
-	label continue_label, break_label;
-	std::vector<std::pair<label,label>> flow_stack;
-	void fillBranch(uint16_t branchOffset,uint16_t targetOffset,bool negated,bool isLong,bool isJump) {
-		assert(!isJump || !negated);
-		uint8_t *dest = currentRoutine->contents + branchOffset;
-		int delta = (targetOffset - (branchOffset + 1 + isLong)) + 2;
-		assert(delta!=0 && delta!=1);
-		if (isJump) {
-			assert(targetOffset != 0xFFF0 && targetOffset != 0xFFF1);
-			if (isLong)
-				dest[0] = delta >> 8, dest[1] = delta;
-			else {
-				if (delta>0 && delta<=255)
-					dest[0] = delta;
-				else {
-					printf("warning - jump delta %d out of range in %s\n",delta,currentRoutine->desc.c_str());
-					dest[0] = 0;
+	thread_local label continue_label, break_label;
+	thread_local std::vector<std::pair<label,label>> flow_stack;
+
+	// Branches and jumps are emitted in their long forms and noted here; once the whole routine
+	// is out, relaxBranches picks the shortest encoding each one can have and closes the gaps.
+	struct branch_site {
+		uint16_t at;			// first branch byte, or the jump opcode
+		label target;
+		bool isJump, onFalse;
+		uint8_t size;			// bytes in the final encoding
+		uint8_t ret;			// rtrue, rfalse or ret_popped opcode if the target just returns
+		uint16_t dest;			// target after following any jumps it lands on
+	};
+	thread_local std::vector<branch_site> the_branches;
+	void placeLabel(label l) {
+		l->offset = currentRoutine->offset;
+	}
+	void emitJump(label l) {
+		the_branches.push_back({currentRoutine->offset,l,true,false});
+		emitByte(LONG_JUMP);
+		emitByte(0);
+		emitByte(0);
+	}
+	void emitBranchTo(label l,bool onFalse) {
+		the_branches.push_back({currentRoutine->offset,l,false,onFalse});
+		emitByte(0);
+		emitByte(0);
+	}
+	// opens up zeroed space in the current routine, moving everything after it along
+	void insertCode(uint16_t at,uint16_t count) {
+		relocatableBlob &r = *currentRoutine;
+		if (r.offset + count > r.size)
+			yyerror("routine too large");
+		memmove(r.contents + at + count,r.contents + at,r.offset - at);
+		memset(r.contents + at,0,count);
+		r.offset += count;
+		std::set<label> labels;
+		for (auto &b: the_branches) {
+			b.at += count;
+			labels.insert(b.target);
+		}
+		for (auto l: labels)
+			if (l != rtrueLabel && l != rfalseLabel && l->offset >= at)
+				l->offset += count;
+		for (auto i=r.relocations; i; i=i->cdr)
+			if (i->car.second >= at)
+				i->car.second += count;
+	}
+	void relaxBranches() {
+		relocatableBlob &r = *currentRoutine;
+		uint16_t end = r.offset;
+		std::map<uint16_t,size_t> jumps;
+		for (size_t i=0; i<the_branches.size(); i++)
+			if (the_branches[i].isJump)
+				jumps[the_branches[i].at] = i;
+		// thread through jumps, and spot targets that just return
+		for (auto &b: the_branches) {
+			uint16_t t = b.target->offset;
+			assert(t != 0xFFFF);
+			for (int hops=0; hops<8 && jumps.count(t); hops++)
+				t = the_branches[jumps[t]].target->offset;
+			b.dest = t;
+			if (t == rtrueLabel->offset || t == rfalseLabel->offset)
+				b.ret = t == rtrueLabel->offset? 0xB0 : 0xB1;
+			else if (t < end && (r.contents[t] == 0xB0 || r.contents[t] == 0xB1 || (b.isJump && r.contents[t] == 0xB8)))
+				b.ret = r.contents[t];
+			b.size = b.ret? 1 : b.isJump? 0 : 1;
+		}
+		auto moved = [&](uint16_t o) {
+			int shrink = 0;
+			for (auto &b: the_branches)
+				if (b.at < o)
+					shrink += (b.isJump? 3 : 2) - b.size;
+			return o - shrink;
+		};
+		// offset field for a given size, as the interpreter adds it to the address after the branch
+		auto delta = [&](const branch_site &b,uint8_t size) {
+			int distance = moved(b.dest) - moved(b.at);
+			return b.dest > b.at? distance - b.size + 2 : distance - size + 2;
+		};
+		// start with everything short and only ever grow, so this settles
+		for (bool changed=true; changed; ) {
+			changed = false;
+			for (auto &b: the_branches) {
+				if (b.ret)
+					continue;
+				uint8_t size = b.size;
+				if (b.isJump) {
+					if (size == 0 && (b.dest <= b.at || delta(b,0) != 2))
+						size = 2;
+					if (size == 2 && (delta(b,2) < 2 || delta(b,2) > 255))
+						size = 3;
+				}
+				else if (size == 1 && (delta(b,1) < 2 || delta(b,1) > 63))
+					size = 2;
+				if (size != b.size) {
+					b.size = size;
+					changed = true;
 				}
 			}
 		}
-		else {
-			if (isLong) {
-				assert(targetOffset != 0xFFF0 && targetOffset != 0xFFF1);
-				assert(delta>=-8192&&delta<=8191);
-				dest[0] = (negated? 0x00 : 0x80) | ((delta >> 8) & 0x3F), dest[1] = delta;
+		std::vector<uint8_t> out;
+		uint16_t from = 0;
+		for (auto &b: the_branches) {
+			out.insert(out.end(),r.contents + from,r.contents + b.at);
+			from = b.at + (b.isJump? 3 : 2);
+			int d = b.ret? 0 : delta(b,b.size);
+			if (b.isJump && b.ret)
+				out.push_back(b.ret);
+			else if (b.ret)
+				out.push_back((b.onFalse? 0x40 : 0xC0) | (b.ret == 0xB0));
+			else if (b.isJump && b.size == 2) {
+				out.push_back(SHORT_JUMP);
+				out.push_back(d);
 			}
-			else {
-				if (targetOffset == 0xFFF0 || targetOffset == 0xFFF1)
-					dest[0] = (negated? 0x40 : 0xC0) | (targetOffset & 1);
-				else if (delta>0 && delta<64)
-					dest[0] = (negated? 0x00 : 0x80) | 0x40 | delta;
-				else {
-					printf("branch delta %d out of range in %s, changing to rfalse\n",delta,currentRoutine->desc.c_str());
-					dest[0] = negated? 0x40 : 0xC0;
-				}
+			else if (b.isJump && b.size == 3) {
+				out.push_back(LONG_JUMP);
+				out.push_back(d >> 8);
+				out.push_back(d);
+			}
+			else if (b.size == 1)
+				out.push_back((b.onFalse? 0x00 : 0x80) | 0x40 | d);
+			else if (!b.isJump) {
+				if (d < -8192 || d > 8191)
+					yyerror("branch out of range in %s",r.desc.c_str());
+				out.push_back((b.onFalse? 0x00 : 0x80) | ((d >> 8) & 0x3F));
+				out.push_back(d);
 			}
 		}
+		out.insert(out.end(),r.contents + from,r.contents + end);
+		for (auto i=r.relocations; i; i=i->cdr)
+			i->car.second = moved(i->car.second);
+		memcpy(r.contents,out.data(),out.size());
+		r.offset = out.size();
+		the_branches.clear();
 	}
-	void placeLabel(label l) {
-		l->offset = currentRoutine->offset;
-		for (auto i=l->references; i; i=i->cdr) {
-			int16_t delta = (currentRoutine->offset - i->car + 2);
-			uint8_t *dest = currentRoutine->contents + i->car;
-			if (dest[0]==0xFF)
-				fillBranch(i->car,l->offset,false,dest[-1]==LONG_JUMP,true);
-			else
-				fillBranch(i->car,l->offset,(dest[0] & 0x80) == 0,!(dest[0] & 0x40),false);
-		}
+
+	// Cleanup over each routine before its branches are relaxed. The rules only look at neighbouring
+	// instructions and never across a branch target, so nothing they touch is reachable another way.
+	enum { P_BRANCH, P_DEAD, P_STACK, P_STORE, P_RULES };
+	const char *peephole_rules[P_RULES] = { "constant branches", "dead code", "stack round trips", "redundant stores" };
+	unsigned peephole_saved[P_RULES];
+	thread_local uint16_t routine_saved[P_RULES];	// for the routine being emitted
+	int op2(const instruction &i) {
+		return i.opcode < 0x80 || (i.opcode >= 0xC0 && i.opcode < 0xE0)? i.opcode & 31 : -1;
 	}
-	void emitJump(label l,bool isLong) {
-		emitByte(isLong? LONG_JUMP : SHORT_JUMP);
-		if (l->offset != 0xFFFF) {
-			fillBranch(currentRoutine->offset,l->offset,false,isLong,true);
-			currentRoutine->offset += 1 + isLong;
-		}
-		else {
-			l->references = new list_node<uint16_t>(currentRoutine->offset,l->references);
-			emitByte(0xFF); // signal jump instead of branch
-			if (isLong)
-				emitByte(0);
+	int op1(const instruction &i) {
+		return i.opcode >= 0x80 && i.opcode < 0xB0? i.opcode & 15 : -1;
+	}
+	// variable written by an instruction that has no other effect, or -1
+	int pureWrite(const instruction &i) {
+		// reading the stack pops it, so dropping the instruction would leave the value behind
+		for (uint8_t j=0; j<i.opCount; j++)
+			if (i.types[j] == (uint8_t)optype::variable && !i.operands[j])
+				return -1;
+		int op = op2(i);
+		if (op == (int)_2op::store)
+			return i.types[0] == (uint8_t)optype::small_constant? i.operands[0] : -1;
+		if (op == (int)_2op::add || op == (int)_2op::sub || op == (int)_2op::mul || op == (int)_2op::or_ ||
+			op == (int)_2op::and_ || op == (int)_2op::loadw || op == (int)_2op::loadb || op1(i) == (int)_1op::load)
+			return i.dest;
+		return -1;
+	}
+	bool readsVariable(const instruction &i,uint8_t v) {
+		if (op1(i) == (int)_1op::load && i.operands[0] == v)
+			return true;
+		for (uint8_t j=op2(i)==(int)_2op::store; j<i.opCount; j++)
+			if (i.types[j] == (uint8_t)optype::variable && i.operands[j] == v)
+				return true;
+		return false;
+	}
+	bool isStorePopped(const instruction &i,uint8_t &v) {
+		if (op2(i) == (int)_2op::store && i.types[1] == (uint8_t)optype::variable && !i.operands[1])
+			v = i.operands[0];
+		else if (i.opcode == 0xE0 + (uint8_t)_var::pull && the_header.version != 6)
+			v = i.operands[0];
+		else
+			return false;
+		return i.types[0] == (uint8_t)optype::small_constant && v;
+	}
+	void peephole() {
+		relocatableBlob &r = *currentRoutine;
+		uint16_t start = the_header.version < 5? 1 + r.contents[0] * 2 : 1;
+		// decodeInstruction expects the version in front, as it is in a story
+		std::vector<uint8_t> code(r.offset + 1);
+		code[0] = the_header.version;
+		memcpy(code.data() + 1,r.contents,r.offset);
+		std::vector<instruction> insns;
+		for (uint16_t pc=start; pc<r.offset; ) {
+			instruction &i = insns.emplace_back();
+			if (!decodeInstruction(code.data(),code.size(),pc + 1,i))
+				return;
+			pc = --i.next;
+			--i.pc;
+		}
+		size_t n = insns.size();
+		struct edit {
+			bool drop, jump;
+			std::vector<uint8_t> bytes;		// replacement, if not empty
+			int shift;						// how far the operands moved within the replacement
+		};
+		std::vector<edit> edits(n);
+		std::vector<int> site(n,-1);
+		for (size_t s=0,k=0; s<the_branches.size(); s++) {
+			while (insns[k].next <= the_branches[s].at)
+				k++;
+			site[k] = s;
+		}
+		std::set<uint16_t> relocated, targets;
+		for (auto i=r.relocations; i; i=i->cdr)
+			relocated.insert(i->car.second);
+		auto findTargets = [&]() {
+			targets.clear();
+			for (size_t k=0; k<n; k++)
+				if (site[k] != -1 && !edits[k].drop)
+					targets.insert(the_branches[site[k]].target->offset);
+		};
+		auto drop = [&](size_t k,int rule) {
+			edits[k].drop = true;
+			routine_saved[rule] += insns[k].next - insns[k].pc;
+		};
+		bool changed = false;
+
+		for (size_t k=0; k<n; k++) {
+			const instruction &i = insns[k];
+			bool constant = site[k] != -1 && relocated.lower_bound(i.pc) == relocated.lower_bound(i.next);
+			for (uint8_t j=0; j<i.opCount; j++)
+				constant = constant && i.types[j] != (uint8_t)optype::variable;
+			bool taken;
+			if (!constant)
+				continue;
+			else if (op1(i) == (int)_1op::jz)
+				taken = !i.operands[0];
+			else if (op2(i) == (int)_2op::je && i.opCount >= 2)
+				taken = i.operands[0] == i.operands[1] || (i.opCount > 2 && i.operands[0] == i.operands[2]) ||
+					(i.opCount > 3 && i.operands[0] == i.operands[3]);
+			else if (op2(i) == (int)_2op::jl || op2(i) == (int)_2op::jg)
+				taken = op2(i) == (int)_2op::jl? (int16_t)i.operands[0] < (int16_t)i.operands[1] : (int16_t)i.operands[0] > (int16_t)i.operands[1];
+			else
+				continue;
+			// the branch bytes are still placeholders here, so the sense comes from the branch site
+			if (taken == !the_branches[site[k]].onFalse) {
+				edits[k].jump = true;
+				edits[k].bytes = { LONG_JUMP,0,0 };
+				routine_saved[P_BRANCH] += i.next - i.pc - 3;
+			}
+			else
+				drop(k,P_BRANCH);
+			changed = true;
+		}
+
+		// dropping code can strand more, so go until nothing else is unreachable
+		for (bool more=true; more; ) {
+			more = false;
+			findTargets();
+			for (size_t k=0; k<n; k++) {
+				if (edits[k].drop || !(edits[k].jump || insns[k].isTerminal()))
+					continue;
+				for (size_t m=k+1; m<n && !targets.count(insns[m].pc); m++)
+					if (!edits[m].drop) {
+						drop(m,P_DEAD);
+						more = changed = true;
+					}
+			}
 		}
+
+		findTargets();
+		for (size_t k=0; k+1<n; k++) {
+			const instruction &i = insns[k];
+			size_t m = k + 1;
+			if (edits[k].drop || edits[k].jump || edits[m].drop || targets.count(insns[m].pc))
+				continue;
+			const instruction &j = insns[m];
+			uint8_t v;
+			int w = pureWrite(i);
+			if (!i.dest && i.branchOffset == -32768 && isStorePopped(j,v)) {
+				// X -> sp, store v sp becomes X -> v
+				edits[k].bytes.assign(r.contents + i.pc,r.contents + i.next);
+				edits[k].bytes.back() = v;
+				drop(m,P_STACK);
+			}
+			else if (i.opcode == 0xE0 + (uint8_t)_var::push && j.opcode == 0xB8) {
+				// push x, ret_popped becomes ret x
+				edits[k].bytes.assign(r.contents + i.pc + 1,r.contents + i.next);
+				edits[k].bytes[0] = 0x8B | (i.types[0] << 4);
+				edits[k].shift = -1;
+				drop(m,P_STACK);
+				routine_saved[P_STACK] += 1;
+			}
+			else if (w > 0 && !readsVariable(i,w) && pureWrite(j) == w && !readsVariable(j,w)) {
+				// the first of two writes to the same variable is never seen
+				drop(k,P_STORE);
+			}
+			else if (w > 0 && op2(i) == (int)_2op::store && i.types[1] == (uint8_t)optype::variable && i.operands[1] == w) {
+				// store v v
+				drop(k,P_STORE);
+			}
+			else
+				continue;
+			changed = true;
+		}
+		if (!changed)
+			return;
+
+		std::vector<uint8_t> out(r.contents,r.contents + start);
+		std::vector<uint16_t> moved(n + 1);
+		for (size_t k=0; k<n; k++) {
+			moved[k] = out.size();
+			if (edits[k].drop)
+				continue;
+			else if (edits[k].bytes.size())
+				out.insert(out.end(),edits[k].bytes.begin(),edits[k].bytes.end());
+			else
+				out.insert(out.end(),r.contents + insns[k].pc,r.contents + insns[k].next);
+		}
+		moved[n] = out.size();
+		auto remap = [&](uint16_t o) {
+			if (o < start || o >= r.offset)
+				return o < start? o : moved[n];
+			size_t k = std::upper_bound(insns.begin(),insns.end(),o,[](uint16_t o,const instruction &i) { return o < i.pc; }) - insns.begin() - 1;
+			return uint16_t(o == insns[k].pc? moved[k] : moved[k] + o - insns[k].pc + edits[k].shift);
+		};
+		std::set<label> labels;
+		std::vector<branch_site> sites;
+		for (size_t k=0; k<n; k++) {
+			if (site[k] == -1 || edits[k].drop)
+				continue;
+			branch_site b = the_branches[site[k]];
+			labels.insert(b.target);
+			if (edits[k].jump) {
+				b.at = moved[k];
+				b.isJump = true;
+				b.onFalse = false;
+			}
+			else
+				b.at = remap(b.at);
+			sites.push_back(b);
+		}
+		for (auto l: labels)
+			if (l != rtrueLabel && l != rfalseLabel)
+				l->offset = remap(l->offset);
+		the_branches.swap(sites);
+		relocatableBlob::relocation_t *relocations = nullptr;
+		for (auto i=r.relocations; i; i=i->cdr) {
+			uint16_t o = i->car.second;
+			size_t k = std::upper_bound(insns.begin(),insns.end(),o,[](uint16_t o,const instruction &i) { return o < i.pc; }) - insns.begin() - 1;
+			if (!edits[k].drop)
+				relocations = new relocatableBlob::relocation_t(std::pair<uint16_t,uint16_t>(i->car.first,remap(o)),relocations);
+		}
+		delete r.relocations;
+		r.relocations = relocations;
+		memcpy(r.contents,out.data(),out.size());
+		r.offset = out.size();
 	}
 	label createLabelHere() {
 		auto l = createLabel();
@@ -418,15 +747,12 @@
 		}
 		virtual bool isLogical() const { return false; }
 		virtual bool isLeaf() const { return false; }
+		virtual bool isBinary() const { return false; }
 		virtual bool isConstant(int &c) const { return false; }
 		bool isZero() const {
 			int c;
 			return isConstant(c) && c==0;
 		}
-		virtual unsigned size() const = 0;
-		unsigned opsize() const {
-			return isLeaf()? size() : size() + 1;
-		}
 		static expr *fold_constant(expr* e);
 		virtual void dump(uint32_t indent) { }
 	};
@@ -440,10 +766,12 @@
 		void emit(uint8_t dest) const {
 			// we defer eval call because there may be unsigned forward references
 			operand lval, rval;
-			right->eval(rval);
-			left->eval(lval);
+			uint8_t mark = next_temp;
+			evalOperand(right,rval);
+			evalOperand(left,lval);
 			emit2op(lval,opcode,rval);
 			emitByte(dest);
+			next_temp = mark;
 		}
 		void eval(operand &o) const {
 			o.value = TOS;
@@ -451,13 +779,21 @@
 			o.relocation = false;
 			emit(TOS);
 		}
-		unsigned size() const {
-			unsigned lSize = left->opsize();
-			unsigned rSize = right->opsize();
-			// if both operands are 1 byte, total size is 3 bytes. otherwise we need a var type encoding.
-			// plus one for dest
-			return lSize + rSize == 2? 4 : lSize + rSize + 3;
+		// Nested arithmetic goes through a spare local, which is free again once the instruction
+		// reading it is out. Operands are read before the result is stored, so e can use the same
+		// local for its own operands.
+		static void evalOperand(expr *e,operand &o) {
+			if (!e->isBinary() || next_temp == 15)
+				return e->eval(o);
+			o.value = next_temp + 1;
+			o.type = optype::variable;
+			o.relocation = false;
+			if (last_temp < o.value)
+				last_temp = o.value;
+			e->emit(o.value);
+			next_temp = o.value;
 		}
+		bool isBinary() const { return true; }
 		bool isConstant(int &v) const {
 			int l, r;
 			if (func && left->isConstant(l) && right->isConstant(r)) {
@@ -497,9 +833,6 @@
 			else 
 				return false; 
 		} 
-		unsigned size() const {
-			return left->opsize() + right->opsize() + 4;
-		}
 		void dump() const {
 			printNode("SHIFT");
 		}
@@ -518,9 +851,6 @@
 			if (opcode == _1op::get_sibling || opcode == _1op::get_child)
 				emitByte(0x42);
 		}
-		unsigned size() const {
-			return 1 + unary->opsize() + 1 + (opcode == _1op::get_sibling || opcode == _1op::get_child);
-		}
 		void dump() const {
 			spaces(); printf("%s\n",opcode_names[(uint8_t)opcode | 0x80]);
 			printNode(unary);
@@ -531,23 +861,9 @@
 		void emit() const {
 			assert(false); // shouldn't be called.
 		}
-		virtual void emitBranch(label target,bool n,bool isLong) {
+		virtual void emitBranch(label target,bool n) {
 			// printf("emitBranch negated %d, n %d\n",negated,n);
-			if (negated)
-				n = !n;
-			if (target->offset != 0xFFFF) {
-				fillBranch(currentRoutine->offset,target->offset,n,isLong,false);
-				currentRoutine->offset += 1 + isLong;
-			}
-			else {
-				target->references = new list_node<uint16_t>(currentRoutine->offset,target->references);
-				if (isLong) {
-					emitByte(n? 0x00 : 0x80);
-					emitByte(0);
-				}
-				else
-					emitByte(n? 0x40 : 0xC0);
-			}
+			emitBranchTo(target,negated? !n : n);
 		}
 		bool negated;
 		bool isLogical() const { return true; }
@@ -559,12 +875,12 @@
 		_2op opcode;
 		expr *left, *right;
 		binary_eval func;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			operand lval, rval;
 			right->eval(rval);
 			left->eval(lval);
 			emit2op(lval,opcode,rval);
-			expr_branch::emitBranch(target,negated,isLong);
+			expr_branch::emitBranch(target,negated);
 		}
 		bool isConstant(int &v) const {
 			int l, r;
@@ -575,9 +891,6 @@
 			else
 				return false;
 		}
-		unsigned size() const {
-			return left->opsize() + right->opsize() + 3; // assume long branch
-		}
 		void dump() const {
 			spaces(); printf("%s\n",opcode_names[(uint8_t)opcode]);
 			printNode(left);
@@ -587,16 +900,13 @@
 	struct expr_binary_branch_store: public expr_binary_branch {
 		expr_binary_branch_store(expr *l,_2op op,bool negated,expr *r,uint8_t d) : expr_binary_branch(l,op,negated,r), dest(d) { }
 		uint8_t dest;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			operand lval, rval;
 			right->eval(rval);
 			left->eval(lval);
 			emit2op(lval,opcode,rval);
 			emitByte(dest);
-			expr_branch::emitBranch(target,negated,isLong);
-		}
-		unsigned size() const {
-			return left->opsize() + right->opsize() + 2 /* 2op var */ + 2 /* branch */;
+			expr_branch::emitBranch(target,negated);
 		}
 		void dump() const {
 			expr_binary_branch::dump();
@@ -607,7 +917,7 @@
 		expr_in(expr *l,expr *r1,expr *r2=nullptr,expr *r3=nullptr) : left(l), right1(r1), right2(r2), right3(r3), expr_branch(false) { }
 		~expr_in() { delete left; delete right1; delete right2; delete right3; }
 		expr *left,*right1,*right2,*right3;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			operand lval, rval1, rval2, rval3;
 			if (right3)
 				right3->eval(rval3);
@@ -621,12 +931,7 @@
 				emitvarop(lval,_2op::je,rval1,rval2);
 			else
 				emit2op(lval,_2op::je,rval1);
-			expr_branch::emitBranch(target,negated,isLong);
-		}
-		unsigned size() const {
-			return right2? 
-				(right3? right3->opsize() + right2->opsize() + right1->opsize() + left->opsize() + 2 : 
-					right2->opsize() + right1->opsize() + left->opsize() + 2) : right1->opsize() + left->opsize() + 2;
+			expr_branch::emitBranch(target,negated);
 		}
 		void dump() const {
 			printNode("in:");
@@ -663,10 +968,6 @@
 			emitvarop(_var::call_vs,o1,o2,o3,o4);
 			emitByte(dest);
 		}
-		unsigned size() const {
-			// size %zd\n",args->size(),3 + args->size()*2);
-			return 2 + args->size() * 2 + 1 /* dest */;
-		}
 		void dump() const {
 			printNode("call:");
 			for (auto i=args; i; i=i->cdr)
@@ -678,14 +979,11 @@
 		~expr_unary_branch() { delete unary; }
 		_1op opcode;
 		expr *unary;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			operand un;
 			unary->eval(un);
 			emit1op(opcode,un);
-			expr_branch::emitBranch(target,negated,isLong);
-		}
-		unsigned size() const {
-			return 1 + unary->opsize() + 2;
+			expr_branch::emitBranch(target,negated);
 		}
 		void dump() const {
 			printNode(opcode_names[(uint8_t)opcode | 0x80]);
@@ -695,15 +993,12 @@
 	struct expr_unary_branch_store: public expr_unary_branch {
 		expr_unary_branch_store(_1op op,bool negated,expr *e,uint8_t d) : expr_unary_branch(op,negated,e), dest(d) { }
 		uint8_t dest;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			operand un;
 			unary->eval(un);
 			emit1op(opcode,un);
 			emitByte(dest);
-			expr_branch::emitBranch(target,negated,isLong);
-		}
-		unsigned size() const {
-			return 1 + unary->size() + 1 + 3;
+			expr_branch::emitBranch(target,negated);
 		}
 		void dump() const {
 			expr_unary_branch::dump();
@@ -716,7 +1011,6 @@
 			o = op;
 		}
 		bool isLeaf() const { return true; }
-		unsigned size() const { return op.type == optype::large_constant? 2 : 1; }
 	};
 	struct expr_literal: public expr_operand {
 		expr_literal(int value) {
@@ -763,11 +1057,8 @@
 		expr_logical_not(expr_branch *e) : unary(), expr_branch(!e->negated) { }
 		~expr_logical_not() { delete unary; }
 		expr_branch *unary;
-		void emitBranch(label target,bool negated,bool isLong) {
-			unary->emitBranch(target,negated,isLong);
-		}
-		unsigned size() const {
-			return unary->size();
+		void emitBranch(label target,bool negated) {
+			unary->emitBranch(target,negated);
 		}
 		void dump() const {
 			printNode("not:");
@@ -788,25 +1079,22 @@
 		expr_logical_and(expr_branch *l,expr_branch *r) : left(l), right(r), expr_branch(false) { }
 		~expr_logical_and() { delete left; delete right; }
 		expr_branch *left, *right;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			// printf("emitBranch logical and, negated %d\n",negated);
 			// (negated=true) if (a and b) means jz a,target; jz b,target
 			// (negated=true) while (a and b) means jz a,target; jz b,target
 			// (negated=false) repeat ... while (a and b) means jz skip; jnz b,target; skip:
 			if (negated) {
-				left->emitBranch(target,true,isLong);
-				right->emitBranch(target,true,isLong);
+				left->emitBranch(target,true);
+				right->emitBranch(target,true);
 			}
 			else {
 				label failed = createLabel();
-				left->emitBranch(failed,true,isLong);
-				right->emitBranch(target,false,isLong);
+				left->emitBranch(failed,true);
+				right->emitBranch(target,false);
 				placeLabel(failed);
 			}
 		}
-		unsigned size() const {
-			return left->size() + right->size();
-		}
 		void dump() const {
 			printNode("and:");
 			printNode(left);
@@ -817,23 +1105,20 @@
 		expr_logical_or(expr_branch*l,expr_branch *r) : left(l), right(r), expr_branch(false) { }
 		~expr_logical_or() { delete left; delete right; }
 		expr_branch *left, *right;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			//printf("emitBranch logical or, negated %d\n",negated);
 			// if (a or b) means jnz a,skip; jz b,target; skip:
 			if (negated) { // not (a or b) -> (not a) and (not b)
 				label success = createLabel();
-				left->emitBranch(success,false,isLong);
-				right->emitBranch(target,true,isLong);
+				left->emitBranch(success,false);
+				right->emitBranch(target,true);
 				placeLabel(success);
 			}
 			else {
-				left->emitBranch(target,false,isLong);
-				right->emitBranch(target,false,isLong);
+				left->emitBranch(target,false);
+				right->emitBranch(target,false);
 			}
 		}
-		unsigned size() const {
-			return left->size() + right->size();
-		}
 		void dump() const {
 			printNode("or:");
 			printNode(left);
@@ -843,12 +1128,9 @@
 	struct expr_saveRestore: public expr_branch {
 		expr_saveRestore(_0op o) : opcode(o), expr_branch(false) { }
 		_0op opcode;
-		void emitBranch(label target,bool negated,bool isLong) {
+		void emitBranch(label target,bool negated) {
 			emit0op(opcode);
-			expr_branch::emitBranch(target,negated,isLong);
-		}
-		unsigned size() const {
-			return 3;
+			expr_branch::emitBranch(target,negated);
 		}
 		void dump() const {
 			printNode("saveRestore");
@@ -868,34 +1150,17 @@
 	}
 	struct stmt: public core {
 		virtual void emit() const = 0;
-		virtual unsigned size() const = 0;
 		virtual bool isReturn() const { return false; }
 		virtual bool isJustReturnBool(int &) const { return false; }
 	};
 	struct stmts: public stmt {
-		stmts(list_node<stmt*> *s): slist(s) { 
-			tsize = 0;
-			for (auto i=slist; i; i=i->cdr)
-				tsize += i->car->size();
-		}
+		stmts(list_node<stmt*> *s): slist(s) { }
 		~stmts() { delete slist; }
 		list_node<stmt*> *slist;
-		unsigned tsize;
 		void emit() const {
-			//unsigned actualSize = currentRoutine->offset;
-			for (auto i=slist; i; i=i->cdr) {
+			for (auto i=slist; i; i=i->cdr)
 				i->car->emit();
-				// printf("accum %u\n",currentRoutine->offset - actualSize);
-			}
-			//actualSize = currentRoutine->offset - actualSize;
-			// assert(computedSize <= tsize);
-			/*if (actualSize > tsize) {
-				for (auto i=slist; i; i=i->cdr)
-					printf("element size %u\n",i->car->size());
-				yyerror("error in size math, actual %d computed %d",actualSize,tsize);
-			}*/
 		}
-		unsigned size() const { return tsize; }
 		bool isReturn() const {
 			for (auto i=slist; i; i=i->cdr)
 				if (i->car->isReturn())
@@ -909,15 +1174,6 @@
 	};
 	struct stmt_flow: public stmt {
 	};
-	size_t jumpPastSize(stmt*s) {
-		return s? (s->size() > 61? 3 : 2) : 0;
-	}
-	size_t includingBranchPast(size_t s) {
-		return s + (s > 61? 2 : 1);
-	}
-	size_t includingJumpPast(size_t s) {
-		return s > 61? 3 : 2;
-	}
 	struct stmt_if: public stmt_flow {
 		stmt_if(expr_branch *e,stmt *t,stmt *f): cond(e), ifTrue(t), ifFalse(f) { }
 		~stmt_if() { delete cond; delete ifTrue; delete ifFalse; }
@@ -939,14 +1195,14 @@
 			}
 
 			if (ifTrue->isJustReturnBool(value)) {
-				cond->emitBranch(value? rtrueLabel : rfalseLabel,false,false);
+				cond->emitBranch(value? rtrueLabel : rfalseLabel,false);
 				if (ifFalse)
 					ifFalse->emit();
 				return;
 			}
 
 			label falseBranch = createLabel();
-			cond->emitBranch(falseBranch,true,ifTrue->size() > (ifFalse? 57 : 59));
+			cond->emitBranch(falseBranch,true);
 			ifTrue->emit();
 			if (ifFalse) {
 				if (ifTrue->isReturn()) {
@@ -955,7 +1211,7 @@
 				}
 				else {
 					label skipFalse = createLabel();
-					emitJump(skipFalse,ifFalse->size() > 59);
+					emitJump(skipFalse);
 					placeLabel(falseBranch);
 					ifFalse->emit();
 					placeLabel(skipFalse);
@@ -964,10 +1220,6 @@
 			else
 				placeLabel(falseBranch);
 		}
-		unsigned size() const {
-			return cond->size() + includingBranchPast(ifTrue->size() + jumpPastSize(ifFalse)) +
-				(ifFalse? ifFalse->size() : 0);
-		}
 		void dump() const {
 			printNode("if:");
 			printNode(cond);
@@ -992,18 +1244,15 @@
 			label falseBranch = createLabel(), top = createLabelHere();
 			continue_label = top;
 			break_label = falseBranch;
-			cond->emitBranch(falseBranch,true,body->size() > 58);
+			cond->emitBranch(falseBranch,true);
 			// TODO: continue and break via a stack
 			body->emit();
-			emitJump(top,true);
+			emitJump(top);
 			placeLabel(falseBranch);
 			continue_label = flow_stack.back().first;
 			break_label = flow_stack.back().second;
 			flow_stack.pop_back();
 		}
-		unsigned size() const { 
-			return cond->size() + includingJumpPast(body->size()) + 3; 
-		}
 		void dump() const {
 			printNode("while:");
 			printNode(cond);
@@ -1019,10 +1268,7 @@
 		void emit() const {
 			auto trueBranch = createLabelHere();
 			body->emit();
-			cond->emitBranch(trueBranch,false,true);
-		}
-		unsigned size() const { 
-			return cond->size() + body->size(); 
+			cond->emitBranch(trueBranch,false);
 		}
 		void dump() const {
 			printNode("repeat:");
@@ -1036,18 +1282,16 @@
 		void emit() const {
 			if (continue_label == nullptr)
 				yyerror("continue found outside of any loop");
-			emitJump(continue_label,true);
+			emitJump(continue_label);
 		}
-		unsigned size() const { return 3; }
 		void dump() const { printNode("continue;"); }
 	};
 	struct stmt_break: public stmt {
 		void emit() const {
 			if (break_label == nullptr)
 				yyerror("break found outside of any loop");
-			emitJump(break_label,true);
+			emitJump(break_label);
 		}
-		unsigned size() const { return 3; }
 		void dump() const { printNode("break;"); }
 	};
 	struct stmt_return: public stmt {
@@ -1072,16 +1316,6 @@
 					emit1op(_1op::ret,o);
 			}
 		}
-		unsigned size() const { 
-			int c;
-			if (value->isConstant(c)) {
-				if (c==0||c==1)
-					return 1;
-				else if (c > 1 && c <= 255)
-					return 2;
-			}
-			return 3;
-		}
 		void dump() const {
 			printNode("return:");
 			printNode(value);
@@ -1098,9 +1332,6 @@
 			left->eval(lop);
 			emit2op(lop,opcode,rop);
 		}
-		unsigned size() const {
-			return left->size() + right->size() + 1;
-		}
 		void dump() const {
 			printNode(opcode_names[(uint8_t)opcode]);
 			printNode(left);
@@ -1117,9 +1348,6 @@
 			value->eval(o);
 			emit1op(opcode,o);
 		}
-		unsigned size() const {
-			return value->size() + 1;
-		}
 		void dump() const {
 			printNode(opcode_names[(uint8_t)opcode | 0x80]);
 			printNode(value);
@@ -1131,9 +1359,6 @@
 		void emit() const {
 			emit0op(opcode);
 		}
-		unsigned size() const {
-			return 1;
-		}
 		void dump() const {
 			printNode(opcode_names[(uint8_t)opcode | 0xB0]);
 		}
@@ -1158,9 +1383,6 @@
 				else
 					value->emit(dest);
 		}
-		unsigned size() const {
-			return value->size() + 1 + value->isLeaf();
-		}
 		void dump() const {
 			printNode("assign:");
 			printNode(value);
@@ -1179,9 +1401,6 @@
 			array->eval(a);
 			emitvarop(opcode,a,i,v);
 		}
-		unsigned size() const {
-			return array->size() + value->size() + index->size() + 2;
-		}
 		void dump() const {
 			printNode("store:");
 			printNode(array);
@@ -1199,9 +1418,6 @@
 			expr0->eval(op0);
 			emitvarop(opcode,op0);
 		}
-		unsigned size() const {
-			return expr0->opsize() + 2;
-		}
 		void dump() const {
 			printNode(opcode_names[(uint8_t)opcode + 0xE0]);
 			printNode(expr0);
@@ -1222,9 +1438,6 @@
 			if (opcode == _var::sread && the_header.version >= 5)
 				emitByte(16 + SCRATCH);
 		}
-		unsigned size() const {
-			return expr0->size() + expr1->size() + 2;
-		}
 		void dump() const {
 			printNode(opcode_names[(uint8_t)opcode + 0xE0]);
 			printNode(expr0);
@@ -1238,27 +1451,45 @@
 			// (alternative is dump to TOS and emit a pop, but this is shorter)
 			call.emit(16 + SCRATCH);
 		}
-		unsigned size() const {
-			return call.size();
-		}
 		expr_call call;
 		void dump() const {
 			call.dump();
 		}
 	};
+	// Strings given to print and print_ret. Once parsing is done, pool_strings picks the ones
+	// worth keeping once in high memory and printing with print_paddr instead of inline.
+	struct pooled_string {
+		unsigned prints = 0, returns = 0;	// uses by print and by print_ret
+		uint16_t blob = 0xFFFF;		// still printed inline if this is 0xFFFF
+		uint16_t bias;				// packed offset into blob, when this is the tail of another string
+		std::vector<uint8_t> encoded;
+	};
+	std::map<std::string,pooled_string> the_string_pool;
+	std::vector<pooled_string*> routine_strings;	// used by the routine being parsed
 	struct stmt_print: public stmt {
-		stmt_print(_0op o,const char *s) : opcode(o), string(s) { }
+		stmt_print(_0op o,const char *s) : opcode(o), string(s) {
+			pooled = &the_string_pool[s];
+			++(opcode == _0op::print_ret? pooled->returns : pooled->prints);
+			routine_strings.push_back(pooled);
+		}
 		~stmt_print() { delete [] string; }
 		const char *string;
 		_0op opcode;
+		pooled_string *pooled;
 		void emit() const {
+			if (pooled->blob != 0xFFFF) {
+				emitByte(0x80 | (uint8_t)_1op::print_paddr);
+				currentRoutine->addRelocation(pooled->blob,pooled->bias);
+				if (opcode == _0op::print_ret) {
+					emit0op(_0op::new_line);
+					emit0op(_0op::rtrue);
+				}
+				return;
+			}
 			emit0op(opcode);
 			currentRoutine->offset += encode_string(currentRoutine->contents + currentRoutine->offset,
 				(currentRoutine->size - currentRoutine->offset) & ~1,string,strlen(string));
 		}
-		unsigned size() const {
-			return 1 + encode_string(nullptr,0,string,strlen(string));
-		}
 		void dump() const {
 			spaces();
 			printf("%s \"%s\"\n",opcode_names[(uint8_t)opcode | 0xB0],string);
@@ -1267,12 +1498,51 @@
 			return opcode == _0op::print_ret;
 		}
 	};
+	// FNV-1a, for cache keys
+	const uint64_t kHashSeed = 0xCBF29CE484222325ULL;
+	void hashBytes(uint64_t &h,const void *data,size_t size) {
+		for (size_t i=0; i<size; i++)
+			h = (h ^ ((const uint8_t*)data)[i]) * 0x100000001B3ULL;
+	}
+
+	// With -i, finished routines are kept in a .tzcache next to the story. A routine's key hashes
+	// every token since the previous routine, with names as they resolved, plus everything global
+	// that changes how code is encoded; if that all matches, so would the bytes and relocations.
+	const uint16_t kCacheVersion = 1;
+	struct cached_routine {
+		uint64_t key;
+		std::vector<uint8_t> contents;
+		std::vector<std::pair<uint16_t,uint16_t>> relocations;	// in list order
+		uint16_t saved[P_RULES];
+	};
+	std::unordered_map<uint64_t,cached_routine> the_cache;
+	std::vector<cached_routine> the_new_cache;
+	bool use_cache;
+	uint64_t token_hash = kHashSeed, context_hash = kHashSeed;
+
+	// Routine bodies are emitted once parsing is done, on as many threads as -j allows. Each one's
+	// blob (and so its index) is created in source order as it's parsed, and a task only writes
+	// to its own blob, so the output doesn't depend on which thread gets to it first.
+	struct routine_task {
+		relocatableBlob *blob;
+		stmt *body;
+		int line;
+		uint64_t key;
+		bool cached;
+		uint16_t saved[P_RULES];
+		std::vector<pooled_string*> strings;
+	};
+	std::vector<routine_task> the_routine_tasks;
+	size_t cache_hits;
+	// Every branch starts out in its longest form, so a routine is emitted into more room than it is
+	// allowed to end up with; the limit only applies once relaxBranches has shrunk it.
+	const uint16_t kMaxRoutineSize = 1024, kRoutineScratchSize = 4 * kMaxRoutineSize;
 	uint16_t emit_routine(int numLocals,stmt *body) {
-		currentRoutine = relocatableBlob::create(1024,UD_HIGH);
+		currentRoutine = relocatableBlob::create(kRoutineScratchSize,UD_HIGH);
 		// printf("%d locals\n",numLocals);
 		emitByte(numLocals);
 		if (the_header.version < 5) {
-			while (numLocals--) { 
+			for (int i=0; i<numLocals; i++) {
 				emitByte(0); 
 				emitByte(0); 
 			}
@@ -1280,15 +1550,217 @@
 		// body->dump();
 		if (!body->isReturn())
 			yyerror("missing return at end of routine (or not all if paths return)");
-		body->emit();
+		hashBytes(token_hash,&context_hash,sizeof(context_hash));
+		the_routine_tasks.push_back({currentRoutine,body,yyline,token_hash});
+		the_routine_tasks.back().strings.swap(routine_strings);
+		token_hash = kHashSeed;
+		return currentRoutine->index;
+	}
+	void emit_body(routine_task &t) {
+		currentRoutine = t.blob;
+		yyline = t.line;
+		uint8_t numLocals = currentRoutine->contents[0];
+		next_temp = last_temp = numLocals;
+		memset(routine_saved,0,sizeof(routine_saved));
+		t.body->emit();
+		if (last_temp > numLocals) {
+			// the temporaries become locals of their own
+			currentRoutine->contents[0] = last_temp;
+			if (the_header.version < 5)
+				insertCode(1 + numLocals * 2,(last_temp - numLocals) * 2);
+		}
+		peephole();
+		relaxBranches();
 		while (currentRoutine->offset & ((1 << story_shift)-1))
 			emitByte(0);
+		if (currentRoutine->offset > kMaxRoutineSize)
+			yyerror("routine too large");
 		currentRoutine->seal(); // arp arp
-		delete body;
-		return currentRoutine->index;
+		memcpy(t.saved,routine_saved,sizeof(t.saved));
+	}
+	void restore_body(routine_task &t,const cached_routine &c) {
+		relocatableBlob &r = *t.blob;
+		memcpy(r.contents,c.contents.data(),c.contents.size());
+		r.offset = c.contents.size();
+		delete r.relocations;
+		r.relocations = nullptr;
+		for (auto i=c.relocations.rbegin(); i!=c.relocations.rend(); i++)
+			r.relocations = new relocatableBlob::relocation_t(*i,r.relocations);
+		r.seal();
+		memcpy(t.saved,c.saved,sizeof(t.saved));
+	}
+	// Set on the threads emitting routine bodies, where yyerror can't just exit while the others
+	// are still running. It throws one of these instead, for emit_routines to report afterwards.
+	thread_local bool deferred_errors;
+	struct compile_error {
+		int line;
+		std::string message;
+	};
+	void emit_routines(unsigned jobs) {
+		// the key only covered the source, so add where its strings ended up
+		for (auto &t: the_routine_tasks)
+			for (auto s: t.strings) {
+				hashBytes(t.key,&s->blob,sizeof(s->blob));
+				hashBytes(t.key,&s->bias,sizeof(s->bias));
+			}
+		std::atomic<size_t> next(0);
+		std::atomic<bool> failed(false);
+		std::mutex error_lock;
+		compile_error error;
+		size_t errorTask = ~size_t(0);
+		auto worker = [&]() {
+			deferred_errors = true;
+			for (size_t i; !failed && (i = next++) < the_routine_tasks.size(); ) {
+				auto &t = the_routine_tasks[i];
+				try {
+					auto c = the_cache.find(t.key);
+					if ((t.cached = c != the_cache.end()))
+						restore_body(t,c->second);
+					else
+						emit_body(t);
+				}
+				catch (compile_error &e) {
+					// the earliest routine wins, so the same source always reports the same error
+					std::lock_guard<std::mutex> lock(error_lock);
+					if (i < errorTask) {
+						error = std::move(e);
+						errorTask = i;
+					}
+					failed = true;
+				}
+				delete t.body;
+			}
+			deferred_errors = false;
+		};
+		std::vector<std::thread> threads;
+		for (unsigned i=1; i<jobs && i<the_routine_tasks.size(); i++)
+			threads.emplace_back(worker);
+		worker();
+		for (auto &t: threads)
+			t.join();
+		if (failed) {
+			yyline = error.line;
+			yyerror("%s",error.message.c_str());
+		}
+		for (auto &t: the_routine_tasks) {
+			for (int i=0; i<P_RULES; i++)
+				peephole_saved[i] += t.saved[i];
+			cache_hits += t.cached;
+			if (use_cache) {
+				// taken now, before placement fills in the relocations
+				cached_routine c { t.key,std::vector<uint8_t>(t.blob->contents,t.blob->contents + t.blob->size) };
+				for (auto i=t.blob->relocations; i; i=i->cdr)
+					c.relocations.push_back(i->car);
+				memcpy(c.saved,t.saved,sizeof(c.saved));
+				the_new_cache.push_back(std::move(c));
+			}
+		}
+		the_routine_tasks.clear();
+	}
+	// Longest first, so a string that ends another one can point into it rather than being stored
+	// at all. A string is pooled along with the strings that end it if all of them together save
+	// more than storing it costs. Returns the bytes saved.
+	int pool_strings(size_t &pooled,size_t &tails) {
+		std::vector<pooled_string*> order;
+		for (auto &s: the_string_pool) {
+			auto &p = s.second;
+			p.encoded.resize(encode_string(nullptr,0,s.first.c_str(),s.first.size()));
+			if (p.encoded.size()) {
+				encode_string(p.encoded.data(),p.encoded.size(),s.first.c_str(),s.first.size());
+				order.push_back(&p);
+			}
+		}
+		std::stable_sort(order.begin(),order.end(),[](pooled_string *a,pooled_string *b) { return a->encoded.size() > b->encoded.size(); });
+		uint16_t align = 1 << story_shift;
+		// inline each use costs the opcode and the string, pooled it's print_paddr (and new_line, rtrue)
+		auto gain = [](pooled_string *p) { int size = p->encoded.size(); return p->prints * (size - 2) + p->returns * (size - 4); };
+		auto storage = [=](pooled_string *p) { return int((p->encoded.size() + align - 1) & ~(align - 1)); };
+		auto place = [&](pooled_string *p,pooled_string *host) {
+			if (host) {
+				p->blob = host->blob;
+				p->bias = (host->encoded.size() - p->encoded.size()) >> story_shift;
+				tails++;
+			}
+			else {
+				auto r = relocatableBlob::create(p->encoded.size(),UD_HIGH,"string");
+				r->copy(p->encoded.data(),p->encoded.size());
+				p->blob = r->index;
+				p->bias = 0;
+			}
+			pooled++;
+		};
+		std::vector<std::pair<pooled_string*,std::vector<pooled_string*>>> groups;
+		for (auto p: order) {
+			size_t size = p->encoded.size();
+			auto g = groups.begin();
+			for (; g != groups.end(); ++g) {
+				auto h = g->first;
+				size_t k = h->encoded.size() - size;
+				if (!(k % align) && (k >> story_shift) < 256 && !memcmp(h->encoded.data() + k,p->encoded.data(),size))
+					break;
+			}
+			if (g != groups.end())
+				g->second.push_back(p);
+			else
+				groups.push_back({p,{}});
+		}
+		int saved = 0;
+		for (auto &g: groups) {
+			int together = gain(g.first) - storage(g.first);
+			for (auto t: g.second)
+				together += gain(t);
+			if (together > 0) {
+				place(g.first,nullptr);
+				for (auto t: g.second)
+					place(t,g.first);
+				saved += together;
+			}
+			else for (auto t: g.second) {
+				// the rest can still be worth pooling on their own
+				int alone = gain(t) - storage(t);
+				if (alone > 0) {
+					place(t,nullptr);
+					saved += alone;
+				}
+			}
+		}
+		return saved;
+	}
+	// Everything outside high memory stays, along with whatever it refers to, directly or not:
+	// from main, the action table, property tables and globals that's every routine and string
+	// that can ever run. Nothing else is reachable from z-code, so it goes. Returns the bytes saved.
+	unsigned remove_unreferenced(size_t &routines,size_t &strings,bool list) {
+		std::vector<bool> reached(the_relocations.size());
+		std::vector<uint16_t> pending;
+		for (uint16_t i=0; i<the_relocations.size(); i++)
+			if ((size_t)the_relocations[i] > 0xFFFF && the_relocations[i]->userData != UD_HIGH) {
+				reached[i] = true;
+				pending.push_back(i);
+			}
+		while (pending.size()) {
+			auto r = the_relocations[pending.back()];
+			pending.pop_back();
+			for (auto i=r->relocations; i; i=i->cdr)
+				if (!reached[i->car.first]) {
+					reached[i->car.first] = true;
+					pending.push_back(i->car.first);
+				}
+		}
+		unsigned saved = 0;
+		for (uint16_t i=0; i<the_relocations.size(); i++)
+			if ((size_t)the_relocations[i] > 0xFFFF && !reached[i]) {
+				auto r = the_relocations[i];
+				bool string = r->desc == "string";
+				++(string? strings : routines);
+				saved += r->size;
+				if (list && !string)
+					printf("removed unreferenced routine %s\n",r->desc.size()? r->desc.c_str() : "(anonymous)");
+				r->destroy();
+			}
+		return saved;
 	}
 
-	uint16_t property_defaults[63];
+	uint16_t property_defaults[64];	// by property number, 1-63
 	uint8_t property_bits[256];
 %}
 
@@ -1898,6 +2370,12 @@ const uint8_t* print_encoded_string(const uint8_t *src,void (*pr)(char ch)) {
 		uint8_t ch = readCode();
 		if (!ch)
 			pr(32);
+		else if (ch<4) {
+			uint8_t index = (ch-1)*32 + readCode();
+			if (index < the_abbreviations.size())
+				for (char c: the_abbreviations[index].text)
+					pr(c);
+		}
 		else if (ch==4)
 			shift = 26;
 		else if (ch==5)
@@ -1918,6 +2396,16 @@ const uint8_t* print_encoded_string(const uint8_t *src,void (*pr)(char ch)) {
 	return src;
 }
 
+// z-characters needed for len characters of s, without abbreviations
+unsigned zchar_cost(const char *s,size_t len) {
+	unsigned cost = 0;
+	while (len--) {
+		uint8_t code = s_EncodedCharacters[(uint8_t)*s++];
+		cost += code == 255? 4 : code > 31? 2 : 1;
+	}
+	return cost;
+}
+
 uint16_t encode_string(uint8_t *dest,size_t destSize,const char *src,size_t srcSize,bool forDict) {
 	uint16_t offset = 0, step = 0;
 	assert((destSize & 1) == 0);
@@ -1942,19 +2430,47 @@ uint16_t encode_string(uint8_t *dest,size_t destSize,const char *src,size_t srcS
 			offset += 2;
 		}
 	};
-	while (srcSize-- && (!destSize || offset < destSize)) {
-		uint8_t code = s_EncodedCharacters[*src++];
+	auto storeChar = [&](uint8_t ch) {
+		uint8_t code = s_EncodedCharacters[ch];
 		if (code == 255) {
 			storeCode(5);
 			storeCode(6);
-			storeCode(src[-1]>>5);
-			storeCode(src[-1]&31);
+			storeCode(ch>>5);
+			storeCode(ch&31);
 		}
 		else {
 			if (code > 31)
 				storeCode(code >> 5);
 			storeCode(code & 31);
 		}
+	};
+	if (forDict || !abbreviations_blob) {
+		while (srcSize-- && (!destSize || offset < destSize))
+			storeChar(*src++);
+	}
+	else {
+		// working back from the end, find the abbreviations that leave the fewest z-characters
+		std::vector<uint16_t> cost(srcSize + 1);
+		std::vector<uint8_t> choice(srcSize,0xFF);
+		for (size_t i=srcSize; i--; ) {
+			cost[i] = zchar_cost(src + i,1) + cost[i+1];
+			for (uint8_t a: abbreviation_index[(uint8_t)src[i]]) {
+				const std::string &t = the_abbreviations[a].text;
+				if (t.size() <= srcSize - i && !memcmp(src + i,t.data(),t.size()) && 2 + cost[i + t.size()] < cost[i]) {
+					cost[i] = 2 + cost[i + t.size()];
+					choice[i] = a;
+				}
+			}
+		}
+		for (size_t i=0; i<srcSize && (!destSize || offset < destSize); ) {
+			if (choice[i] != 0xFF) {
+				storeCode(1 + choice[i] / 32);
+				storeCode(choice[i] % 32);
+				i += the_abbreviations[choice[i]].text.size();
+			}
+			else
+				storeChar(src[i++]);
+		}
 	}
 	// pad with shift characters
 	if (step) {
@@ -2098,6 +2614,76 @@ int encode_string(const char *src) {
 	return 0; // TODO
 }
 
+// z-characters saved by an abbreviation used that many times: each use takes two instead of
+// the text itself, but the text is stored once (padded out to a word) along with a table entry
+int abbreviation_savings(unsigned uses,unsigned cost) {
+	return int(uses) * (int(cost) - 2) - int((cost + 2) / 3 * 3) - 3;
+}
+
+unsigned count_uses(const std::string &text,const std::string &s) {
+	unsigned uses = 0;
+	for (size_t i=text.find(s); i!=std::string::npos; i=text.find(s,i + s.size()))
+		++uses;
+	return uses;
+}
+
+// Greedily picks up to count abbreviations from text (every string literal, separated by zeros),
+// returning the estimated savings in z-characters. Text an abbreviation claims is zeroed, so
+// later candidates can only lose uses; that makes a candidate's old score an upper bound, and
+// it only has to be recounted when it comes to the top of the queue.
+int choose_abbreviations(std::string &text,unsigned count) {
+	const size_t kMaxLength = 20, kCandidates = 1000;
+	std::unordered_map<std::string_view,unsigned> counts;
+	for (size_t i=0; i<text.size(); i++)
+		for (size_t len=2; text[i] && len<=kMaxLength && i+len<=text.size() && text[i+len-1]; len++)
+			counts[std::string_view(text.data() + i,len)]++;
+	std::vector<std::pair<int,std::string>> candidates;
+	for (auto &c: counts) {
+		int savings = abbreviation_savings(c.second,zchar_cost(c.first.data(),c.first.size()));
+		if (savings > 0)
+			candidates.push_back({savings,std::string(c.first)});
+	}
+	std::sort(candidates.begin(),candidates.end(),std::greater<>());
+	if (candidates.size() > kCandidates)
+		candidates.resize(kCandidates);
+	std::priority_queue<std::pair<int,std::string>> queue(candidates.begin(),candidates.end());
+	int saved = 0;
+	while (the_abbreviations.size() < count && !queue.empty()) {
+		auto c = queue.top();
+		queue.pop();
+		const std::string &s = c.second;
+		int savings = abbreviation_savings(count_uses(text,s),zchar_cost(s.data(),s.size()));
+		if (savings <= 0)
+			continue;
+		if (!queue.empty() && savings < queue.top().first) {
+			queue.push({savings,s});
+			continue;
+		}
+		for (size_t i=text.find(s); i!=std::string::npos; i=text.find(s,i + s.size()))
+			memset(&text[i],0,s.size());
+		the_abbreviations.push_back({s,nullptr});
+		saved += savings;
+	}
+	return saved;
+}
+
+// encodes the chosen abbreviations and their table, then lets encode_string use them
+void build_abbreviations() {
+	if (the_abbreviations.empty())
+		return;
+	for (auto &a: the_abbreviations) {
+		uint16_t size = encode_string(nullptr,0,a.text.data(),a.text.size());
+		a.blob = relocatableBlob::create(size,UD_WORD,"abbreviation");
+		a.blob->offset = encode_string(a.blob->contents,size,a.text.data(),a.text.size());
+	}
+	auto table = relocatableBlob::create(the_abbreviations.size() * 2,UD_STATIC,"abbreviations");
+	for (uint8_t i=0; i<the_abbreviations.size(); i++) {
+		table->addRelocation(the_abbreviations[i].blob->index);
+		abbreviation_index[(uint8_t)the_abbreviations[i].text[0]].push_back(i);
+	}
+	abbreviations_blob = table;
+}
+
 void emit1op(_1op opcode,operand uval) {
 	if (uval.type==optype::large_constant)
 		emitByte(0x80 + (uint8_t)opcode);
@@ -2264,81 +2850,76 @@ void disassemble(uint16_t blob) {
 	}
 }
 
-int yych, yylen, yypass, yyline, yyscope;
-char yytoken[32];
-FILE *yyinput;
-inline int yynext() { if (yych!=EOF) { yych = getc(yyinput); if (yych == 10) ++yyline; } return yych; }
+// The source is read once and scanned once into the_tokens, with every name interned and
+// classified against the keyword and opcode tables when it's first seen; both passes then
+// replay the array, so all that's left per token is the symbol lookup.
+struct token {
+	int16_t type;		// character, bison token, or IDENT for a name that isn't a keyword
+	uint32_t line;
+	int32_t value;		// INTLIT value, opcode, or index into the_names/the_strings/the_words
+};
+const int16_t IDENT = -2;
+std::vector<token> the_tokens;
+std::vector<std::string> the_names, the_strings;
+std::vector<std::map<dict_entry,uint16_t>::iterator> the_words;
+std::unordered_map<std::string,token> name_classes;
+size_t next_token;
+
+int yych, yylen, yypass, yyscope;
+thread_local int yyline;
+char yybuffer[32];
+const char *yytoken = yybuffer;
+const char *yysource, *yysourceEnd;
+inline int yynext() { if (yych!=EOF) { yych = yysource < yysourceEnd? (uint8_t)*yysource++ : EOF; if (yych == 10) ++yyline; } return yych; }
+
+// keyword or opcode token for a name, or IDENT with a fresh index into the_names
+token classify(const char *name) {
+	auto r = rw.find(name);
+	if (r != rw.end())
+		return { int16_t(r->second), 0, 0 };
+	auto z = f_0op.find(name);
+	if (z != f_0op.end())
+		return { STMT_0OP, 0, (int32_t)z->second };
+	auto o = f_1op.find(name);
+	if (o != f_1op.end())
+		return { STMT_1OP, 0, (int32_t)o->second };
+	auto t = f_2op.find(name);
+	if (t != f_2op.end())
+		return { STMT_2OP, 0, (int32_t)t->second };
+	auto v1 = f_varop1.find(name);
+	if (v1 != f_varop1.end())
+		return { STMT_VAROP1, 0, (int32_t)v1->second };
+	auto v2 = f_varop2.find(name);
+	if (v2 != f_varop2.end())
+		return { STMT_VAROP2, 0, (int32_t)v2->second };
+	the_names.push_back(name);
+	return { IDENT, 0, int32_t(the_names.size() - 1) };
+}
 
-int yylex_() {
+int scan(token &tok) {
 	yylen = 0;
 	while (isspace(yych))
 		yynext();
+	tok.line = yyline;
+	tok.value = 0;
 
 	if (isalpha(yych)||yych=='#'||yych=='_'||yych=='$') {
 		do {
-			if (yylen==sizeof(yytoken)-1)
+			if (yylen==sizeof(yybuffer)-1)
 				yyerror("token too long");
-			yytoken[yylen++] = yych;
+			yybuffer[yylen++] = yych;
 			yynext();
 		} while (isalnum(yych)||yych=='_'||yych=='\'');
-		yytoken[yylen] = 0;
-		// reserved words and builtin funcs first
-		auto r = rw.find(yytoken);
-		if (r != rw.end())
-			return r->second;
-		auto z = f_0op.find(yytoken);
-		if (z != f_0op.end()) {
-			yylval.zeroOp = z->second;
-			return STMT_0OP;
-		}
-		auto o = f_1op.find(yytoken);
-		if (o != f_1op.end()) {
-			yylval.oneOp = o->second;
-			return STMT_1OP;
-		}
-		auto t = f_2op.find(yytoken);
-		if (t != f_2op.end()) {
-			yylval.twoOp = t->second;
-			return STMT_2OP;
-		}
-		auto v1 = f_varop1.find(yytoken);
-		if (v1 != f_varop1.end()) {
-			yylval.varOp = v1->second;
-			return STMT_VAROP1;
-		}		
-		auto v2 = f_varop2.find(yytoken);
-		if (v2 != f_varop2.end()) {
-			yylval.varOp = v2->second;
-			return STMT_VAROP2;
-		}		
-		// check locals, which take precedence over other symbols
-		if (the_locals.size()) {
-			auto l = the_locals.back()->find(yytoken);
-			if (l != the_locals.back()->end()) {
-				yylval.ival = l->second.ival;
-				return LNAME;
-			}
-		}
-		// finally search globals
-		auto s = the_globals.find(yytoken);
-		if (s != the_globals.end()) {
-			yylval.ival = s->second.ival;
-			return s->second.token;
-		}
-		// otherwise it's a new symbol (do no actual work on first pass)
-		if (yypass==1)
-			return NEWSYM;
-		else {
-			if (the_locals.size())
-				yylval.sym = &*the_locals.back()->insert(std::pair<std::string,symbol>(yytoken,{0,0})).first;
-			else
-				yylval.sym = &*the_globals.insert(std::pair<std::string,symbol>(yytoken,{0,0})).first;
-			return NEWSYM;
-		}
+		yybuffer[yylen] = 0;
+		auto c = name_classes.find(yybuffer);
+		if (c == name_classes.end())
+			c = name_classes.insert({yybuffer,classify(yybuffer)}).first;
+		tok.value = c->second.value;
+		return c->second.type;
 	}
 	else switch(yych) {
 		case '-':
-			yytoken[yylen++] = '-';
+			yybuffer[yylen++] = '-';
 			yynext();
 			if (yych<'0'||yych>'9') {
 				if (yych=='>') {
@@ -2356,11 +2937,11 @@ int yylex_() {
 		case '0': case '1': case '2': case '3': case '4':
 		case '5': case '6': case '7': case '8': case '9':
 			do {
-				yytoken[yylen++] = yych;
+				yybuffer[yylen++] = yych;
 				yynext();
 			} while (yych>='0'&&yych<='9');
-			yytoken[yylen] = 0;
-			yylval.ival = atoi(yytoken);
+			yybuffer[yylen] = 0;
+			tok.value = atoi(yybuffer);
 			return INTLIT;
 		case '+': 
 			if (yynext()=='+') {
@@ -2369,30 +2950,16 @@ int yylex_() {
 			}
 			else
 				return '+';
-		case '@': yynext(); yylval.ival = yych; yynext(); return INTLIT;
+		case '@': yynext(); tok.value = yych; yynext(); return INTLIT;
 		case '(': case ')':
 		case '~': case '*': case ':': case '.': case '%':
 		case '&': case '|': case ';':
 		case ',': case '!':
-			yytoken[0] = yych;
-			yynext();
-			return yytoken[0];
-		case '[':
-			++yyscope;
-			yynext();
-			return '[';
-		case ']':
-			--yyscope;
-			yynext();
-			return ']';
-		case '{':
-			++yyscope;
-			yynext();
-			return '{';
-		case '}':
-			--yyscope;
+		case '[': case ']': case '{': case '}': {
+			int ch = yych;
 			yynext();
-			return '}';		
+			return ch;
+		}
 		case '=':
 			yynext();
 			if (yych=='=') {
@@ -2434,22 +3001,22 @@ int yylex_() {
 			if (yych == '/') {
 				while (yynext() != EOF && yych != 10)
 					;
-				return yylex_();	// silly, should just goto top, hopefully compiler spots tail recursion :)
+				return scan(tok);	// silly, should just goto top, hopefully compiler spots tail recursion :)
 			}
 			else if (yych == '*') {
 				yynext();
 				while (true)
 					if ((yynext()=='*'&&yynext()=='/')||yych==EOF)
-						return yynext(), yylex_();
+						return yynext(), scan(tok);
 			}
 			else
 				return '/';
 		case '\'': {
 			yynext();
 			while (yych != '\'' && yych != EOF && yych != 32) {
-				if (yylen+1==sizeof(yytoken))
+				if (yylen+1==sizeof(yybuffer))
 					yyerror("dictionary word way too long");
-				yytoken[yylen++] = tolower(yych);
+				yybuffer[yylen++] = tolower(yych);
 				yynext();
 			}
 			// turn a space into a new dict word
@@ -2457,22 +3024,17 @@ int yylex_() {
 				yych = '\'';
 			else
 				yynext();
-			yytoken[yylen] = 0;
+			yybuffer[yylen] = 0;
 			
 			dict_entry de = {};
-			encode_string(de.encoded,dict_entry_size,yytoken,yylen,true);
-			if (yypass==1) {
-				the_dictionary[de] = -1;
-				yylval.ival = -1;
-			}
-			else {
-				yylval.ival = the_dictionary[de];
-			}
+			encode_string(de.encoded,dict_entry_size,yybuffer,yylen,true);
+			the_words.push_back(the_dictionary.insert({de,0xFFFF}).first);
+			tok.value = the_words.size() - 1;
 			return DICT;
 		}
 		case '"': {
 			const unsigned maxString = 512;
-			char *sval = new char[maxString];
+			char sval[maxString];
 			unsigned offset = 0;
 			char term = yych;
 			while (yynext()!=EOF && yych!=term) {
@@ -2498,8 +3060,8 @@ NEWLINE:
 				}
 			}
 			yynext();
-			sval[offset] = 0;
-			yylval.sval = sval;
+			the_strings.push_back(std::string(sval,offset));
+			tok.value = the_strings.size() - 1;
 			return STRLIT;
 		}
 		default:
@@ -2510,8 +3072,121 @@ NEWLINE:
 	}
 }
 
+// reads and scans the whole source
+void tokenize(const char *name) {
+	FILE *f = fopen(name,"rb");
+	if (!f)
+		yyerror("unable to open '%s'",name);
+	fseek(f,0,SEEK_END);
+	long size = ftell(f);
+	if (size < 0)
+		yyerror("unable to read '%s'",name);
+	rewind(f);
+	char *source = new char[size];
+	if (fread(source,1,size,f) != (size_t)size)
+		yyerror("unable to read '%s'",name);
+	fclose(f);
+	yysource = source;
+	yysourceEnd = source + size;
+	yych = 32;
+	yyline = 1;
+	token t;
+	while ((t.type = scan(t)) != EOF)
+		the_tokens.push_back(t);
+	delete[] source;
+}
+
+int yylex_() {
+	if (next_token == the_tokens.size())
+		return EOF;
+	const token &t = the_tokens[next_token++];
+	yyline = t.line;
+	yytoken = "";
+	switch (t.type) {
+		case '[': case '{':
+			++yyscope;
+			return t.type;
+		case ']': case '}':
+			--yyscope;
+			return t.type;
+		case INTLIT:
+			yylval.ival = t.value;
+			return INTLIT;
+		case STMT_0OP: yylval.zeroOp = (_0op)t.value; return STMT_0OP;
+		case STMT_1OP: yylval.oneOp = (_1op)t.value; return STMT_1OP;
+		case STMT_2OP: yylval.twoOp = (_2op)t.value; return STMT_2OP;
+		case STMT_VAROP1: case STMT_VAROP2: yylval.varOp = (_var)t.value; return t.type;
+		case DICT:
+			yylval.ival = yypass==1? -1 : the_words[t.value]->second;
+			return DICT;
+		case STRLIT: {
+			// the parser owns (and deletes) what it's given; pass 1 doesn't look
+			if (yypass==1)
+				yylval.sval = nullptr;
+			else {
+				const std::string &s = the_strings[t.value];
+				char *sval = new char[s.size() + 1];
+				memcpy(sval,s.c_str(),s.size() + 1);
+				yylval.sval = sval;
+			}
+			return STRLIT;
+		}
+		case IDENT:
+			break;
+		default:
+			return t.type;
+	}
+	const std::string &name = the_names[t.value];
+	yytoken = name.c_str();
+	// check locals, which take precedence over other symbols
+	if (the_locals.size()) {
+		auto l = the_locals.back()->find(name);
+		if (l != the_locals.back()->end()) {
+			yylval.ival = l->second.ival;
+			return LNAME;
+		}
+	}
+	// finally search globals
+	auto s = the_globals.find(name);
+	if (s != the_globals.end()) {
+		yylval.ival = s->second.ival;
+		return s->second.token;
+	}
+	// otherwise it's a new symbol (do no actual work on first pass)
+	if (yypass==1)
+		return NEWSYM;
+	else {
+		if (the_locals.size())
+			yylval.sym = &*the_locals.back()->insert(std::pair<std::string,symbol>(name,{0,0})).first;
+		else
+			yylval.sym = &*the_globals.insert(std::pair<std::string,symbol>(name,{0,0})).first;
+		return NEWSYM;
+	}
+}
+
+// feeds what a token means, rather than where it is in the source, into the next routine's key
+void hash_token(int token) {
+	hashBytes(token_hash,&token,sizeof(token));
+	if (token == EOF)
+		return;
+	const ::token &t = the_tokens[next_token - 1];
+	if (t.type == IDENT) {
+		hashBytes(token_hash,yytoken,strlen(yytoken));
+		if (token != NEWSYM)
+			hashBytes(token_hash,&yylval.ival,sizeof(yylval.ival));
+	}
+	else if (token == STRLIT)
+		hashBytes(token_hash,the_strings[t.value].data(),the_strings[t.value].size());
+	else if (token == DICT)
+		hashBytes(token_hash,&yylval.ival,sizeof(yylval.ival));
+	else if (token == INTLIT || token == STMT_0OP || token == STMT_1OP || token == STMT_2OP || token == STMT_VAROP1 || token == STMT_VAROP2)
+		hashBytes(token_hash,&t.value,sizeof(t.value));
+}
+
 int yylex() {
 	int token = yylex_();
+	if (use_cache && yypass==2)
+		hash_token(token);
 	if (yydebug) {
 		printf("(%d)",yyscope);
 		if (token==EOF)
@@ -2527,6 +3202,12 @@ int yylex() {
 void yyerror(const char *fmt,...) {
 	va_list args;
 	va_start(args,fmt);
+	if (deferred_errors) {
+		char message[256];
+		vsnprintf(message,sizeof(message),fmt,args);
+		va_end(args);
+		throw compile_error { yyline,message };
+	}
 	fprintf(stderr,"line %d: ",yyline);
 	vfprintf(stderr,fmt,args);
 	putc('\n',stderr);
@@ -2534,6 +3215,188 @@ void yyerror(const char *fmt,...) {
 	exit(1);
 }
 
+// A missing, stale or damaged cache just means everything gets compiled.
+void load_cache(const char *name) {
+	FILE *f = fopen(name,"rb");
+	if (!f)
+		return;
+	char magic[4];
+	uint16_t version;
+	uint32_t count;
+	if (fread(magic,4,1,f) == 1 && !memcmp(magic,"TZRC",4) && fread(&version,2,1,f) == 1 && version == kCacheVersion &&
+		fread(&count,4,1,f) == 1) {
+		while (count--) {
+			cached_routine c;
+			uint16_t size, relocs;
+			if (fread(&c.key,8,1,f) != 1 || fread(&size,2,1,f) != 1 || size > kMaxRoutineSize)
+				break;
+			c.contents.resize(size);
+			if (fread(c.contents.data(),1,size,f) != size || fread(&relocs,2,1,f) != 1)
+				break;
+			c.relocations.resize(relocs);
+			if (fread(c.relocations.data(),sizeof(c.relocations[0]),relocs,f) != relocs || fread(c.saved,sizeof(c.saved),1,f) != 1)
+				break;
+			the_cache[c.key] = std::move(c);
+		}
+	}
+	fclose(f);
+}
+
+// keeps just the routines from this compile, so the cache doesn't grow without bound
+bool save_cache(const char *name) {
+	FILE *f = fopen(name,"wb");
+	if (!f)
+		return false;
+	uint32_t count = the_new_cache.size();
+	fwrite("TZRC",4,1,f);
+	fwrite(&kCacheVersion,2,1,f);
+	fwrite(&count,4,1,f);
+	for (auto &c: the_new_cache) {
+		uint16_t size = c.contents.size(), relocs = c.relocations.size();
+		fwrite(&c.key,8,1,f);
+		fwrite(&size,2,1,f);
+		fwrite(c.contents.data(),1,size,f);
+		fwrite(&relocs,2,1,f);
+		fwrite(c.relocations.data(),sizeof(c.relocations[0]),relocs,f);
+		fwrite(c.saved,sizeof(c.saved),1,f);
+	}
+	return !fclose(f);
+}
+
+// A profile (from tinyzterp -profile) counts calls and print_paddr by byte address in the story
+// it ran. The map written alongside each build says which routine or string was at each
+// address, under a key that survives a rebuild: the routine's name, or a hash of the contents,
+// which don't depend on the layout until relocations are applied.
+std::string blob_key(const relocatableBlob *r) {
+	if (r->desc.size() && r->desc != "string")
+		return r->desc;
+	uint64_t h = kHashSeed;
+	hashBytes(h,r->contents,r->size);
+	char key[20];
+	snprintf(key,sizeof(key),"#%016llx",(unsigned long long)h);
+	return key;
+}
+
+struct map_entry {
+	uint32_t address, count;
+	std::string key;
+};
+
+// Counts by key. A profile of the last build is read through its map; one taken before that can
+// still be used through the counts that map carried over. Returns the checksum of the story that
+// was profiled, or -1 if there's nothing usable.
+int read_profile(const char *profileName,const char *mapName,std::unordered_map<std::string,uint32_t> &counts) {
+	FILE *f = fopen(profileName,"r");
+	if (!f)
+		return -1;
+	unsigned checksum = ~0U, story = ~0U, source = ~0U, address, count;
+	std::map<uint32_t,uint32_t> hits;
+	if (fscanf(f,"tzprofile %x",&checksum) == 1)
+		while (fscanf(f,"%x %u",&address,&count) == 2)
+			hits[address] += count;
+	fclose(f);
+	std::vector<map_entry> entries;
+	if ((f = fopen(mapName,"r"))) {
+		char key[256];
+		if (fscanf(f,"tzmap %x %x",&story,&source) == 2)
+			while (fscanf(f,"%x %u %255s",&address,&count,key) == 3)
+				entries.push_back({address,count,key});
+		fclose(f);
+	}
+	if (checksum == story) {
+		// the map is in address order, and a pooled string can be printed from partway in
+		for (auto &h: hits) {
+			auto e = std::upper_bound(entries.begin(),entries.end(),h.first,[](uint32_t a,const map_entry &e) { return a < e.address; });
+			if (e != entries.begin())
+				counts[std::prev(e)->key] += h.second;
+		}
+	}
+	else if (checksum == source) {
+		for (auto &e: entries)
+			if (e.count)
+				counts[e.key] += e.count;
+	}
+	else {
+		fprintf(stderr,"'%s' isn't from the last build of this story, so it was ignored\n",profileName);
+		return -1;
+	}
+	return checksum;
+}
+
+// writes the map for the story just written to storyName; source is what read_profile returned
+bool write_map(const char *mapName,const char *storyName,int source,const std::vector<std::string> &keys,const std::vector<uint32_t> &heat) {
+	FILE *f = fopen(storyName,"rb");
+	if (!f)
+		return false;
+	fseek(f,0,SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	std::vector<uint8_t> story(size);
+	fread(story.data(),1,size,f);
+	fclose(f);
+	if (!(f = fopen(mapName,"w")))
+		return false;
+	fprintf(f,"tzmap %04x %x\n",storyChecksum(story.data(),size),(unsigned)source);
+	for (uint16_t i=relocatableBlob::firstPlaced; i!=0xFFFF; i=the_relocations[i]->nextPlaced)
+		if (keys[i].size())
+			fprintf(f,"%x %u %s\n",the_relocations[i]->address,heat[i],keys[i].c_str());
+	return !fclose(f);
+}
+
+// writes name + "p" holding the packed form of the story in name
+bool packFile(const char *name) {
+	FILE *f = fopen(name,"rb");
+	if (!f)
+		return false;
+	fseek(f,0,SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	std::vector<uint8_t> story(size), packed(packBound(size));
+	fread(story.data(),1,size,f);
+	fclose(f);
+	uint32_t packedSize = packStory(story.data(),size,packed.data());
+	char packedName[72];
+	snprintf(packedName,sizeof(packedName),"%sp",name);
+	printf("packing '%s' into '%s' (%ld bytes to %u)...\n",name,packedName,size,packedSize);
+	FILE *output = fopen(packedName,"wb");
+	if (!output)
+		return false;
+	fwrite(packed.data(),1,packedSize,output);
+	fclose(output);
+	return true;
+}
+
+// writes name + ".tzc" holding what the interpreter would otherwise work out every time it loads
+// the story; the PicoCalc can't write it back to its card, so it's made here
+bool analyzeFile(const char *name) {
+	FILE *f = fopen(name,"rb");
+	if (!f)
+		return false;
+	fseek(f,0,SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	std::vector<uint8_t> story(size);
+	bool ok = size >= (long)sizeof(storyHeader) && fread(story.data(),1,size,f) == (size_t)size;
+	fclose(f);
+	if (!ok)
+		return false;
+	// the interpreter covers what the header's length does, as far as the file goes
+	const storyHeader *h = (const storyHeader*) story.data();
+	uint32_t length = h->storyLength.getU() << (h->version==3? 1 : h->version<=5? 2 : 3);
+	if (length > (uint32_t)size)
+		length = size;
+	analysisCache c;
+	c.describe(story.data(),length);
+	analyzeStory(story.data(),length,c.analysis);
+	char cacheName[72];
+	snprintf(cacheName,sizeof(cacheName),"%s.tzc",name);
+	FILE *output = fopen(cacheName,"wb");
+	if (!output)
+		return false;
+	ok = fwrite(&c,sizeof(c),1,output) == 1;
+	return !fclose(output) && ok;
+}
+
 int main(int argc,char **argv) {
 
 	/* uint8_t dest[6];
@@ -2547,10 +3410,18 @@ int main(int argc,char **argv) {
 	int release_number = 0;
 	enum { R_OBJECTS=1,R_ROUTINES=2,R_GLOBALS=4,R_DICTIONARY=8,R_ACTIONS=16,R_SUMMARY=32,R_ALL=63};
 	int report = 0;
+	bool pack = false;
+	const char *profileName = nullptr;
+	unsigned jobs = std::max(std::thread::hardware_concurrency(),1U);
 	while (--argc && **++argv=='-') {
 		const char *arg = *argv + 1;
 		switch(*arg++) {
+			case 'a': abbreviation_count = std::min(std::max(atoi(arg),0),96); break;
 			case 'd': yydebug = 1; break;
+			case 'i': use_cache = true; break;
+			case 'j': if (atoi(arg) > 0) jobs = atoi(arg); break;
+			case 'p': pack = true; break;
+			case 'P': profileName = arg; break;
 			case 'r':  if (*arg) while (*arg) switch (*arg++) {
 				case 'S': report |= R_SUMMARY; break;
 				case 'O': report |= R_OBJECTS; break;
@@ -2566,7 +3437,12 @@ int main(int argc,char **argv) {
 	}
 	if (!argc)
 		yyerror("missing input tz name");
+	// an existing story (from anywhere) can just be packed
+	const char *inExt = strrchr(argv[0],'.');
+	if (pack && inExt && inExt[1]=='z' && inExt[2]>='1' && inExt[2]<='8' && !inExt[3])
+		return packFile(argv[0])? 0 : 1;
 	init(zversion);
+	tokenize(argv[0]);
 
 	char outname[64];
 	strlcpy(outname,argv[0],sizeof(outname)-4);
@@ -2578,11 +3454,14 @@ int main(int argc,char **argv) {
 	*ext++ = the_header.version + '0';
 	*ext = 0;
 	// printf("compiling release %d\n",release_number);
+	std::string cacheName = std::string(outname) + ".tzcache";
+	std::string mapName = std::string(outname) + ".tzmap";
+	if (use_cache)
+		load_cache(cacheName.c_str());
 
 	for (yypass=1; yypass<=2; yypass++) {
-		yyinput = fopen(argv[0],"r");
+		next_token = 0;
 		int nextObject = 1;
-		yych = 32;
 		yyline = 1;
 		yyscope = 0;
 		if (yypass==1) {
@@ -2650,9 +3529,33 @@ int main(int argc,char **argv) {
 			the_globals["$object_count"] = { INTLIT, int16_t(the_object_table.size() - 1) };
 			the_globals["$dict_word_count"] = { INTLIT, int16_t(the_dictionary.size()) };
 			header_blob = relocatableBlob::create(64,UD_DYNAMIC,"story header");
+			std::string strings;
+			for (auto &s: the_strings) {
+				strings.append(s);
+				strings.push_back(0);
+			}
+			int saved = choose_abbreviations(strings,abbreviation_count);
+			build_abbreviations();
+			if (report & R_SUMMARY)
+				printf("%zu abbreviations, saving about %d bytes\n",the_abbreviations.size(),saved * 2 / 3);
 		}
 		else {
+			uint8_t version = the_header.version;
+			hashBytes(context_hash,&kCacheVersion,sizeof(kCacheVersion));
+			hashBytes(context_hash,&version,sizeof(version));
+			for (auto &a: the_abbreviations)
+				hashBytes(context_hash,a.text.c_str(),a.text.size() + 1);
 			yyparse();
+			size_t pooled = 0, tails = 0;
+			int saved = pool_strings(pooled,tails);
+			if (report & R_SUMMARY)
+				printf("%zu strings pooled (%zu sharing the end of another), saving %d bytes\n",pooled,tails,saved);
+			emit_routines(jobs);
+			if (use_cache && (report & R_SUMMARY))
+				printf("%zu of %zu routines from the cache\n",cache_hits,the_new_cache.size());
+			if (report & R_SUMMARY)
+				for (int i=0; i<P_RULES; i++)
+					printf("%u bytes saved by removing %s\n",peephole_saved[i],peephole_rules[i]);
 			actions_blob->storeWord(-1); // terminate the action list
 			synonyms_blob->storeWord(-1); // terminate the synonym list
 			globals_blob->addRelocation(actions_blob->index);
@@ -2700,7 +3603,8 @@ int main(int argc,char **argv) {
 			header_blob->addRelocation(dictionary_blob->index); // +8 dictionary table
 			header_blob->addRelocation(object_blob->index); // +10 object table
 			header_blob->addRelocation(globals_blob->index); // +12 globals
-			header_blob->addRelocation(dictionary_blob->index); // +14 static memory
+			// +14 static memory, which starts with the abbreviations if there are any
+			header_blob->addRelocation(abbreviations_blob? abbreviations_blob->index : dictionary_blob->index);
 			header_blob->offset += 2;
 			time_t now;
 			time(&now);
@@ -2711,11 +3615,45 @@ int main(int argc,char **argv) {
 			header_blob->place();
 			globals_blob->place();
 			object_blob->place();
+			size_t deadRoutines = 0, deadStrings = 0;
+			unsigned removed = remove_unreferenced(deadRoutines,deadStrings,report & R_ROUTINES);
+			if (report & R_SUMMARY)
+				printf("%zu routines and %zu strings nothing refers to were removed, saving %u bytes\n",deadRoutines,deadStrings,removed);
 			relocatableBlob::placeAll(UD_DYNAMIC);
+			if (abbreviations_blob) {
+				abbreviations_blob->place();
+				for (auto &a: the_abbreviations)
+					a.blob->place(1);
+			}
 			relocatableBlob::placeAll(UD_STATIC);
-			relocatableBlob::placeAll(UD_HIGH);
+			// with a profile, the routines and strings it saw run most go first and the rest after.
+			// every build gets a map, so whatever build gets profiled can feed the next -P one.
+			std::vector<std::string> keys(the_relocations.size());
+			std::vector<uint32_t> heat(the_relocations.size());
+			std::unordered_map<std::string,uint32_t> counts;
+			int profileSource = profileName? read_profile(profileName,mapName.c_str(),counts) : -1;
+			size_t high = 0, hot = 0;
+			for (size_t i=0; i<the_relocations.size(); i++)
+				if ((size_t)the_relocations[i] > 0xFFFF && the_relocations[i]->userData == UD_HIGH) {
+					keys[i] = blob_key(the_relocations[i]);
+					auto c = counts.find(keys[i]);
+					if (c != counts.end())
+						heat[i] = c->second;
+					++high;
+					hot += heat[i] != 0;
+				}
+			if (profileName) {
+				if (report & R_SUMMARY)
+					printf("%zu of %zu routines and strings in high memory ran in the profile\n",hot,high);
+				relocatableBlob::placeAll(UD_HIGH,heat);
+			}
+			else
+				relocatableBlob::placeAll(UD_HIGH);
 
-			header_blob->storeWord(0); // +24 abbreviations
+			if (abbreviations_blob)
+				header_blob->addRelocation(abbreviations_blob->index); // +24 abbreviations
+			else
+				header_blob->storeWord(0);
 			header_blob->storeWord((relocatableBlob::nextAddress + ((1<<story_shift)-1)) >> story_shift); // length of file
 			header_blob->offset = 60;
 			header_blob->storeByte('0');
@@ -2728,6 +3666,14 @@ int main(int argc,char **argv) {
 			FILE *output = fopen(outname,"w");
 			relocatableBlob::writeAll(output);
 			fclose(output);
+			if (pack && !packFile(outname))
+				yyerror("unable to pack '%s'",outname);
+			if (!analyzeFile(outname))
+				yyerror("unable to write '%s.tzc'",outname);
+			if (use_cache && !save_cache(cacheName.c_str()))
+				yyerror("unable to write '%s'",cacheName.c_str());
+			if (!write_map(mapName.c_str(),outname,profileSource,keys,heat))
+				yyerror("unable to write '%s'",mapName.c_str());
 
 			if (report & R_ROUTINES) {
 				disassemble(entry_point_index);
@@ -2789,7 +3735,6 @@ int main(int argc,char **argv) {
 				}
 			}
 		}
-		fclose(yyinput);
 	}
 
 	// typical order
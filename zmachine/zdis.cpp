@@ -1,11 +1,13 @@
-// clang++ -std=c++17 zdis.cpp -o zdis
+// clang++ -std=c++17 zdis.cpp analysis.cpp -o zdis
 
 #define ENABLE_DEBUG 1
 #include "header.h"
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 
 #include "opcodes.h"
+#include "analysis.h"
 
 const uint8_t storyScales[] = { 0,0,0,2,4,4,0,8,8 };
 
@@ -26,6 +28,7 @@ static const char zscii_default[] =
 	"\033\n0123456789.,!?_#'\"/\\-:()";
 static const char *zscii = zscii_default;
 static word *abbreviations;
+static int story_end;	// strings that guess wrong stop here instead of running off the end
 
 void stdio_output_char(void*,uint8_t ch) { putchar(ch); }
 
@@ -35,9 +38,15 @@ static int print_zscii(const uint8_t *b,int addr,void *closure = nullptr,void (*
 	auto printZ = [&](uint8_t ch) {
 		assert(ch<32);
 		if (abbrev) {
+			// abbreviations can't nest; if one seems to, this isn't really a string
+			static bool inAbbrev;
 			int inner = abbrev-32+ch;
 			abbrev = 0;
-			print_zscii(b,abbreviations[inner].getU2(),closure,output_char);
+			if (!inAbbrev) {
+				inAbbrev = true;
+				print_zscii(b,abbreviations[inner].getU2(),closure,output_char);
+				inAbbrev = false;
+			}
 			shift = 0;
 		}
 		else if (extended) {
@@ -64,105 +73,85 @@ static int print_zscii(const uint8_t *b,int addr,void *closure = nullptr,void (*
 			shift = 0;
 		}
 	};
-	do {
+	while (addr + 1 < story_end) {
 		printZ((b[addr]>>2) & 31);
 		printZ(((b[addr]&3)<<3) | (b[addr+1]>>5));
 		printZ(b[addr+1]&31);
 		addr+=2;
-	} while (!(b[addr-2] & 0x80));
+		if (b[addr-2] & 0x80)
+			break;
+	}
 	return addr;
 }
 
-static int no_printf(const char*,...) {
-	return 0;
-}
-
 typedef int (*pf)(const char*,...);
 
-int dis(const storyHeader *h,int pc,pf xprintf = printf) {
-	// keep track of the furthest forward branch we've seen.
-	// if we encounter an unconditional return and we're at or beyond, we're done.
+static const char *var_name(uint8_t t) {
+	static char buf[8];
+	if (!t)
+		snprintf(buf,sizeof(buf),"(sp)");
+	else if (t < 16)
+		snprintf(buf,sizeof(buf),"L%d",t-1);
+	else
+		snprintf(buf,sizeof(buf),"G%d",t-16);
+	return buf;
+}
+
+// prints everything after the address, without a trailing newline
+void print_instruction(const storyHeader *h,const instruction &insn,pf xprintf = printf) {
 	// 0b00 - large constant (2 bytes)
 	// 0b01 - small constant (1 byte)
 	// 0b10 - variable (0=tos, 1-15=local, 16-255=global 1-240)
 	// 0b11 - omitted altogether
+	(*xprintf)("[%03x] %s ",insn.opcode,opcode_names[insn.opcode]);
+	for (int i=0; i<insn.opCount; i++) {
+		int16_t op = insn.operands[i];
+		switch ((optype)insn.types[i]) {
+			case optype::large_constant:
+			case optype::small_constant: (*xprintf)("%d ",op); break;
+			default: (*xprintf)("%s ",var_name(op)); break;
+		}
+	}
+	if (insn.dest != -1)
+		(*xprintf)("-> %s ",var_name(insn.dest));
+	if (insn.branchOffset != -32768) {
+		bool branch_cond = insn.branchCond;
+		if (insn.branchOffset==0||insn.branchOffset==1)
+			(*xprintf)("?%s%s",branch_cond?"":"~",insn.branchOffset?"rtrue":"rfalse");
+		else
+			(*xprintf)("?%s%x",branch_cond?"":"~",insn.branchTarget());
+	}
+	if (insn.opcode == 0xB2 || insn.opcode == 0xB3) {
+		(*xprintf)("\"");
+		print_zscii((const uint8_t*)h,insn.pc+1,(void*)xprintf,[](void* p,uint8_t x) { (*(pf)p)("%c",x); });
+		(*xprintf)("\"");
+	}
+}
+
+int dis(const storyHeader *h,int pc,pf xprintf = printf) {
+	// keep track of the furthest forward branch we've seen.
+	// if we encounter an unconditional return and we're at or beyond, we're done.
 	int highest = pc;
 	int end = h->storyLength.getU() * storyScales[h->version];
 	const uint8_t *b = (uint8_t*) h;
 
-	auto varTypes = [](uint8_t t) {
-		static char buf[8];
-		if (!t)
-			snprintf(buf,sizeof(buf),"(sp)");
-		else if (t < 16)
-			snprintf(buf,sizeof(buf),"L%d",t-1);
-		else
-			snprintf(buf,sizeof(buf),"G%d",t-16);
-		return buf;
-	};
-
 	while (pc < end) {
 		(*xprintf)("%06x: ",pc);
-		uint16_t opcode = b[pc++];
-		if (opcode == 0xBE && h->version>=5)
-			opcode = 0x100 | b[pc++];
-		if (opcode >= 0x120 || opcode_names[opcode][0]=='?') {
-			(*xprintf)("[%03x] -- error in disassembly\n",opcode);
+		instruction insn;
+		if (!decodeInstruction(b,end,pc,insn)) {
+			(*xprintf)("[%03x] -- error in disassembly\n",b[pc]);
 			return 0;
 		}
-		(*xprintf)("[%03x] %s ",opcode,opcode_names[opcode]);
-
-		uint16_t types = opTypes[opcode >> 4] << 8;
-		if (!types)
-			types = b[pc++] << 8;
-		if (opcode==236 || opcode==250)
-			types |= b[pc++];
-		else
-			types |= 255;
+		print_instruction(h,insn,xprintf);
 		// remember the last op (used for jumps)
-		int16_t op = 0;
-		while (types != 0xFFFF) {
-			op = b[pc++];
-			switch (types & 0xC000) {
-				case 0x0000: op = (op<<8) | b[pc++]; (*xprintf)("%d ",op); break;
-				case 0x4000: (*xprintf)("%d ",op); break;
-				case 0x8000: (*xprintf)("%s ",varTypes(op)); break;
-			}
-			types = (types << 2) | 0x3;
-		}
-		
-		uint8_t decode_byte = decode[opcode] >> version_shift[h->version];
-		if (decode_byte & 1)
-			(*xprintf)("-> %s ",varTypes(b[pc++]));
-		if (decode_byte & 2) {
-			int16_t branch_offset = b[pc++];
-			bool branch_cond = branch_offset >> 7;
-			branch_offset &= 127;
-			if (branch_offset & 64)
-				branch_offset &= 63;
-			else {
-				
-				if (branch_offset & 32)
-					branch_offset |= 0xC0;
-				branch_offset = (branch_offset << 8) | b[pc++];
-			}
-			if (branch_offset==0||branch_offset==1)
-				(*xprintf)("?%s%s",branch_cond?"":"~",branch_offset?"rtrue":"rfalse");
-			else {
-				// track the furthest forward branch we've seen to detect end of routine.
-				if (branch_offset > 0 && pc + branch_offset - 2 > highest)
-					highest = pc + branch_offset - 2;
-				(*xprintf)("?%s%x",branch_cond?"":"~",pc + branch_offset - 2);
-			}
-		}
-		else if (opcode == 0x8C && op > 0 && pc + op - 2 > highest) {
+		int16_t op = insn.opCount? insn.operands[insn.opCount-1] : 0;
+		uint16_t opcode = insn.opcode;
+		pc = insn.next;
+		// track the furthest forward branch we've seen to detect end of routine.
+		if (insn.branchOffset > 1 && (int)insn.branchTarget() > highest)
+			highest = insn.branchTarget();
+		else if (insn.branchOffset == -32768 && opcode == 0x8C && op > 0 && pc + op - 2 > highest)
 			highest = pc + op - 2;
-		}
-		if (opcode == 0xB2 || opcode == 0xB3) {
-			(*xprintf)("\"");
-			pc = print_zscii(b,pc,(void*)xprintf,[](void* p,uint8_t x) { (*(pf)p)("%c",x); });
-			(*xprintf)("\"");
-		}
 		// printf("  ;highest=%06x",highest);
 		(*xprintf)("\n");
 
@@ -293,13 +282,114 @@ void dump_dictionary(const storyHeader *h) {
 	}
 }
 
+// decodes the "T pc opcode op0 op1 result" lines the interpreter prints when it faults
+int dump_trace(const storyHeader *story,const char *traceName) {
+	FILE *f = fopen(traceName,"r");
+	if (!f) {
+		printf("cannot open trace file %s\n",traceName);
+		return 1;
+	}
+	const uint8_t *b = (const uint8_t*) story;
+	int end = story->storyLength.getU() * storyScales[story->version];
+	char line[128];
+	while (fgets(line,sizeof(line),f)) {
+		unsigned pc, opcode, op0, op1, result;
+		if (sscanf(line,"T %x %x %x %x %x",&pc,&opcode,&op0,&op1,&result) != 5)
+			continue;
+		instruction insn;
+		printf("%06x: ",pc);
+		if (!decodeInstruction(b,end,pc,insn)) {
+			printf("[%03x] -- not a valid instruction\n",opcode & 0xFFF);
+			continue;
+		}
+		else if (insn.opcode != (opcode & 0xFFF)) {
+			printf("[%03x] -- trace doesn't match story\n",opcode & 0xFFF);
+			continue;
+		}
+		print_instruction(story,insn);
+		printf("  ; ");
+		if (opcode >> 12)
+			printf("%04x",op0);
+		if ((opcode >> 12) > 1)
+			printf(" %04x",op1);
+		// a call's result is stored after the callee returns, so it isn't in the record
+		if (insn.dest != -1 && !insn.isCall())
+			printf(" => %04x",result);
+		printf("\n");
+	}
+	fclose(f);
+	return 0;
+}
+
+// writes the call graph and every routine's basic blocks, as json or as a graphviz digraph
+int dump_graph(const storyHeader *story,const char *format) {
+	bool json = !strcmp(format,"json");
+	if (!json && strcmp(format,"dot")) {
+		printf("graph format must be json or dot\n");
+		return 1;
+	}
+	const uint8_t *b = (const uint8_t*) story;
+	storyGraph g;
+	g.build(b,story->storyLength.getU() * storyScales[story->version]);
+	static const char *sources[] = { "start", "call", "property", "global", "table" };
+	if (json)
+		printf("{\"routines\":[\n");
+	else
+		printf("digraph story {\n\tnode [shape=box,fontname=monospace];\n");
+	for (uint32_t i=0; i<g.routines.count; i++) {
+		const storyGraph::routine &r = g.routines[i];
+		uint32_t instructions = 0;
+		for (uint32_t j=0; j<r.blockCount; j++)
+			instructions += g.blocks[r.firstBlock + j].instructions;
+		if (json) {
+			printf("\t{\"addr\":%u,\"entry\":%u,\"locals\":%d,\"found\":\"%s\",\"complete\":%s,\"instructions\":%u,\"calls\":[",
+				r.addr,r.entry,r.locals,sources[r.found],r.complete? "true" : "false",instructions);
+			for (uint32_t j=0; j<r.callCount; j++)
+				printf("%s%u",j? "," : "",g.calls[r.firstCall + j]);
+			printf("],\"blocks\":[");
+			for (uint32_t j=0; j<r.blockCount; j++) {
+				const storyGraph::block &bl = g.blocks[r.firstBlock + j];
+				printf("%s\n\t\t{\"start\":%u,\"end\":%u,\"instructions\":%d,\"successors\":[",j? "," : "",bl.start,bl.end,bl.instructions);
+				for (uint32_t k=0; k<bl.successorCount; k++)
+					printf("%s%u",k? "," : "",g.successors[bl.firstSuccessor + k]);
+				printf("]}");
+			}
+			printf("]}%s\n",i+1 < g.routines.count? "," : "");
+		}
+		else {
+			printf("\tsubgraph cluster_%x {\n\t\tlabel=\"routine %x (%s, %u instructions%s)\";\n",
+				r.addr,r.addr,sources[r.found],instructions,r.complete? "" : ", incomplete");
+			for (uint32_t j=0; j<r.blockCount; j++) {
+				const storyGraph::block &bl = g.blocks[r.firstBlock + j];
+				printf("\t\tb%x [label=\"%06x-%06x\\n%d instructions\"];\n",bl.start,bl.start,bl.end,bl.instructions);
+				for (uint32_t k=0; k<bl.successorCount; k++)
+					printf("\t\tb%x -> b%x;\n",bl.start,g.successors[bl.firstSuccessor + k]);
+			}
+			printf("\t}\n");
+			// calls go from the routine's entry block to the callee's
+			for (uint32_t j=0; j<r.callCount; j++) {
+				int32_t callee = g.find(g.calls[r.firstCall + j]);
+				if (r.blockCount && callee >= 0 && g.routines[callee].blockCount)
+					printf("\tb%x -> b%x [style=dashed];\n",r.entry,g.routines[callee].entry);
+			}
+		}
+	}
+	printf(json? "]}\n" : "}\n");
+	return 0;
+}
+
 int main(int argc,char **argv) {
 	storyHeader *story = getStory(argv[1]);
+	story_end = story->storyLength.getU() * storyScales[story->version];
+	if (argc > 3 && !strcmp(argv[2],"-graph"))
+		return dump_graph(story,argv[3]);
 	printf("version %d serial[%c%c%c%c%c%c]\n",story->version,
 		story->serial[0],story->serial[1],story->serial[2],story->serial[3],story->serial[4],story->serial[5]);
 	abbreviations = (word*)((char*)story + story->abbreviationsAddr.getU());
 	if (story->version >= 5 && story->alphabetTableAddress.getU())
 		zscii = (char*)story + story->alphabetTableAddress.getU();
+	if (argc > 3 && !strcmp(argv[2],"-trace"))
+		return dump_trace(story,argv[3]);
 	printf("high memory: %x\n",story->highMemoryAddr.getU());
 	printf("initial pc: %x\n",story->initialPCAddr.getU());
 	printf("dictionary: %x\n",story->dictionaryAddr.getU());
@@ -324,15 +414,37 @@ int main(int argc,char **argv) {
 	int stop = story->storyLength.getU() * storyScales[story->version];
 	const uint8_t *b = (const uint8_t*) story;
 
+	// anything the call graph doesn't account for is taken to be a string
+	storyGraph g;
+	g.build(b,stop);
+	if (g.routines.count && (int)g.routines[0].addr < start)
+		start = g.routines[0].addr;
 	int sn = 0;
 	while (start < stop) {
-		int test;
-		if (b[start] > 15 || !(test = routine(story,start,no_printf))) {
+		// the initial pc is listed as a routine with no locals
+		bool initial = start == (int)story->initialPCAddr.getU() - 1;
+		int32_t r = g.find(initial? start + 1 : start);
+		if (initial || (r >= 0 && g.routines[r].blockCount)) {
+			int end = routine(story,start);
+			// the end of routine heuristic can stop short of blocks the graph knows about
+			for (uint32_t i=0; r>=0 && i<g.routines[r].blockCount; i++)
+				if ((int)g.blocks[g.routines[r].firstBlock + i].end > end)
+					end = g.blocks[g.routines[r].firstBlock + i].end;
+			start = roundUp(end);
+		}
+		else {
+			// and never let a string swallow the next routine
+			int next = stop;
+			for (uint32_t i=0; i<g.routines.count; i++)
+				if ((int)g.routines[i].addr > start && g.routines[i].blockCount) {
+					next = g.routines[i].addr;
+					break;
+				}
 			printf("S%d: ",++sn);
 			start = roundUp(print_zscii(b,start));
+			if (start > next)
+				start = next;
 		}
-		else
-			start = roundUp(routine(story,start));
 		printf("\n");
 	}
 }